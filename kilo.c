@@ -7,12 +7,20 @@
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
@@ -22,6 +30,36 @@
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
+// seconds a status message stays on the message bar
+#define KILO_MSG_TIMEOUT 5
+// bytes of input read ahead, a power of two
+#define KILO_INPUT_SIZE 65536
+// milliseconds to wait for the rest of an escape sequence
+#define KILO_ESC_TIMEOUT 100
+// the most threads a search uses
+#define KILO_SEARCH_THREADS 16
+// a file with fewer rows and bytes than these is searched right in the prompt
+#define KILO_SEARCH_MIN_ROWS 4096
+#define KILO_SEARCH_SYNC 65536
+/**
+ * the most bytes scanned between two looks at whether the search is
+ * cancelled, and about the bytes of a piece handed to a search thread
+ */
+#define KILO_SEARCH_BLOCK (1 << 20)
+// milliseconds between two redraws of the progress of a search
+#define KILO_SEARCH_TICK 100
+// the most pieces handed to one writev() while saving
+#define KILO_SAVE_IOV 1024
+// bytes of journal records kept before they are written out
+#define KILO_JOURNAL_BUF 65536
+// seconds between an edit and the sync of the journal that records it
+#define KILO_JOURNAL_SYNC 1
+// the most bytes the undo log keeps, the oldest groups go first
+#define KILO_UNDO_MAX (64 << 20)
+// bytes of the chunks the row slabs are carved from
+#define KILO_SLAB_CHUNK (1 << 20)
+// the columns between two saved states of the highlighter in a long row
+#define KILO_HL_CHECKPOINT 256
 
 #define CTRL_KEY(k) ((k)&0x1f)
 
@@ -36,7 +74,10 @@ enum editorKey
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    // the terminal wraps pasted text in these with bracketed paste mode on
+    PASTE_START,
+    PASTE_END
 };
 
 enum editorHighlight
@@ -54,6 +95,32 @@ enum editorHighlight
 #define HL_HIGHLIGHT_NUMBERS (1<<0)
 #define HL_HIGHLIGHT_STRING (1<<1)
 
+// character classes of the compiled syntax
+#define CC_SEPARATOR (1<<0)
+#define CC_DIGIT (1<<1)
+#define CC_KEYWORD (1<<2) // a keyword can start with it
+
+// the chars of the row still point into the memory-mapped file
+#define ROW_MAPPED (1<<0)
+// rflags: the row has tabs, so it has a render of its own with them expanded
+#define ROW_TABS (1<<0)
+// the hl spans, and the render of a row with tabs, are built
+#define ROW_RENDERED (1<<1)
+
+/**
+ * a span is a run of columns with the same highlight until the next one
+ * starts, the int column it starts at followed by the highlight byte. They
+ * are packed in the slabs, so the column is copied in and out.
+ */
+#define HL_SPAN_SIZE ((int)sizeof(int) + 1)
+#define HL_SPAN(row, k) (&(row)->hl[(k) * HL_SPAN_SIZE])
+#define HL_SPAN_HL(row, k) (HL_SPAN(row, k)[sizeof(int)])
+
+// the attribute of a screen cell is the editorHighlight of it, maybe inverted
+#define ATTR_INVERSE 0x10
+// unchanged cells between two changed spans of a line before it is cheaper to move the cursor
+#define KILO_SCREEN_GAP 8
+
 /* data */
 
 struct editorSyntax
@@ -67,18 +134,318 @@ struct editorSyntax
     int flags;
 };
 
+/**
+ * the current syntax compiled by editorSyntaxCompile(), the keywords are a
+ * trie over the chars they use, so finding the keyword at some column costs
+ * the length of the keyword, not the number of keywords
+ */
+struct hlmatcher
+{
+    unsigned char cclass[256];
+    unsigned char alpha[256]; // the index of a char in the trie, 0 if no keyword has it
+    int nalpha;
+    int *next; // next[node * nalpha + alpha[c]] is the child of a node, 0 if none
+    int *kw; // the index of the keyword ending at a node, -1 if none
+    unsigned char *kwhl; // HL_KEYWORD1 or HL_KEYWORD2 of that keyword
+    int scs_len;
+    int mcs_len;
+    int mce_len;
+    // the most columns a step of the highlighter looks ahead
+    int lookahead;
+};
+
+// the state of the highlighter at some column of a row
+struct hlstate
+{
+    int pos;
+    char prev_sep;
+    char prev_number; // the column before is a number, a digit or '.' goes on with it
+    char in_string;
+    char in_comment;
+};
+
+// the size classes of the slabs, from 16 to 16384 bytes
+#define SLAB_CLASSES 43
+// the class of a piece too big for the slabs, it is malloc()ed
+#define SLAB_BIG 255
+
+// the slabs the text, render and hl spans of the rows are taken from
+struct slabs
+{
+    char *free[SLAB_CLASSES]; // freed pieces, linked through their first bytes
+    char *chunk; // where the next piece is carved
+    int left; // bytes left in the chunk
+};
+
 // editor row
 typedef struct erow
 {
-    int idx;
     int size;
     int rsize;
+    // chars is a gap buffer, the gap is at [gap, gap + gaplen)
+    int gap;
+    int gaplen;
     char *chars;
+    // only a row with tabs has one, the others are drawn from chars
     char *render;
+    // {n, cx, rx, cx, rx...} of the tabs of a rendered row, NULL if it has none
+    int *tabs;
+    // hl_n spans of HL_SPAN_SIZE bytes, the first one starts at column 0. None is all HL_NORMAL
     unsigned char *hl;
+    int hl_n;
+    // highlighter states every KILO_HL_CHECKPOINT columns of a long row
+    struct hlstate *hl_cp;
+    int hl_ncp;
+    // the comment state of the row above when this one was highlighted, -1 if never
+    int hl_in_comment;
     int hl_open_comment;
+    int flags;
+    // ROW_TABS and ROW_RENDERED, apart from flags since the search threads read those
+    int rflags;
+    // the matches of the search in the row, {search gen, n, col, len, ...}, NULL if unknown
+    int *matches;
 } erow;
 
+// the cells of a frame, row by row, screencols cells each
+struct screen
+{
+    char *ch;
+    unsigned char *attr;
+};
+
+// the input read so far but not decoded into keys yet, [head, tail) of buf
+struct inring
+{
+    unsigned char buf[KILO_INPUT_SIZE];
+    unsigned int head, tail; // they only grow, the index in buf is masked
+};
+
+// where a match of the search starts
+struct match
+{
+    int row;
+    int col;
+    int len;
+};
+
+struct matchlist
+{
+    struct match *m;
+    int n;
+    int cap;
+};
+
+// where the forward DFA was at a symbol of the row, and the furthest match end from there
+struct rememo
+{
+    unsigned int gen; // the row it is from, the others are free
+    int pos;
+    int state;
+    int end;
+};
+
+// what searching a row for a regex needs besides the DFAs, kept from row to row
+struct rescan
+{
+    unsigned char *starts; // whether a match starts at each symbol
+    int cap;
+    struct rememo *memo; // a hash table of memocap slots
+    int memocap, memon;
+    unsigned int gen;
+    int resets; // the resets of the forward DFA when the memo was started
+    int *path; // {pos, state} pairs of the current forward run
+    int pathcap;
+};
+
+// a piece of the rows searched by one thread, about KILO_SEARCH_BLOCK bytes
+struct searchjob
+{
+    int from, to;
+    const char *q;
+    int qlen;
+    const struct regex *re; // NULL for a plain search
+    struct matchlist list;
+};
+
+/**
+ * the threads of the search, started by the first search that needs them
+ * and kept for the next ones. They take the pieces of the rows off a cursor
+ * in order, so a few long rows are shared between them as well as many
+ * short ones.
+ */
+struct searchpool
+{
+    pthread_t tid[KILO_SEARCH_THREADS];
+    int nthreads;
+    pthread_mutex_t lock; // guards everything below
+    pthread_cond_t wake; // a search was handed to the threads
+    pthread_cond_t idle; // the last thread is done with it
+    unsigned int gen; // bumped for every search handed to the threads
+    int busy; // the threads still on it
+    // the next row to hand out
+    struct rownode *leaf;
+    int pos, row;
+    struct searchjob *jobs; // the pieces handed out so far, in order
+    int njobs, jobcap;
+};
+
+// the matches of the query in the whole file, sorted by position
+struct search
+{
+    char *query;
+    int qlen;
+    struct matchlist found;
+    int current; // the match the cursor is on, -1 if none
+    int from_row, from_col; // where the cursor was when the search started
+    int active;
+    int regex; // the query is a regex, toggled with Ctrl-R in the prompt
+    struct regex *re; // NULL if the regex is not valid
+    unsigned int gen; // bumped for every query, the rows cache matches of one gen
+    // the DFAs of the main thread for the rows on the screen
+    struct dfa *fwd, *rev;
+    struct rescan scan;
+    struct searchpool pool;
+    int running;
+    int cancel;
+    int done; // rows searched so far, read while the threads run
+};
+
+// what a save process sends back when it is done
+struct saveresult
+{
+    long long len; // -1 if it failed
+    int err;
+};
+
+// a save running in a child process, on a snapshot of the rows
+struct save
+{
+    pid_t pid; // 0 if no save is running
+    int fd; // the read end of the pipe the result comes through
+    int dirty; // E.dirty when the snapshot was taken
+    long long jpos; // the end of the journal when the snapshot was taken
+};
+
+// the edits that are written to the journal
+enum journalOp
+{
+    J_INSERT_ROW = 1,
+    J_INSERT_ROWS,
+    J_DEL_ROW,
+    J_INSERT,
+    J_DEL_CHAR,
+    J_TRUNCATE,
+    J_SET_ROW,
+    J_DELETE
+};
+
+// the start of a journal, it names the file the records apply to
+struct jhead
+{
+    char magic[8];
+    long long size;
+    long long mtime;
+    long long ino;
+};
+
+// a record, followed by len bytes of text. A J_DELETE has no text, len is only a count
+struct jrec
+{
+    int op;
+    int row;
+    int at;
+    int len;
+};
+
+struct journal
+{
+    int on; // edits are recorded
+    int kept; // the journal found at startup was left alone, nothing is recorded over it
+    int fd; // -1 until there is something to write
+    char *path;
+    long long pos; // the end of the journal file
+    char *buf; // records not written yet
+    int len;
+    int cap;
+    int unsynced;
+    time_t due; // when the unsynced records get synced
+};
+
+/**
+ * a record of the undo log: the edit, the text it needs to be undone and
+ * redone, and then its own size, so the log can be walked backwards
+ */
+enum undoOp
+{
+    U_GROUP = 1, // row and at are where the cursor was before the group
+    U_INSERT_ROW,
+    U_INSERT_ROWS, // at is the number of rows
+    U_DEL_ROW,
+    U_INSERT,
+    U_DELETE,
+    U_TRUNCATE,
+    U_SET_ROW // the old text, then len2 bytes of the new one
+};
+
+struct urec
+{
+    int op;
+    int row;
+    int at;
+    int len;
+    int len2;
+};
+
+// what kind of key was last, typing is grouped by word
+enum undoKind
+{
+    UK_OTHER,
+    UK_TYPE,
+    UK_BACK,
+    UK_DEL
+};
+
+struct undo
+{
+    char *log;
+    int len;
+    int cap;
+    int pos; // the end of the records that are applied, the rest can be redone
+    int last; // where the last record starts, -1 if it may not be merged into
+    int boundary; // the next record starts a group
+    int cx, cy; // the cursor when the group started
+    int kind;
+    int lastc;
+    int paused; // undo, redo and loading a file aren't recorded
+    int overflow; // the group didn't fit, it isn't recorded
+};
+
+#define ROWTREE_FANOUT 64
+
+/**
+ * a node of the row tree, the leaves hold the rows themselves. A leaf of the
+ * mapped file that nothing touched yet only knows where its lines start,
+ * base + lines[i], its rows are made when they are first needed.
+ */
+struct rownode
+{
+    int leaf;
+    int n; // the number of rows in a leaf, or of children in an inner node
+    struct rownode *prev, *next; // the neighbour leaves
+    char *base;
+    int *lines; // n + 1 offsets, the last one is where the next leaf starts
+    int hl_in_comment, hl_open_comment; // the comment state of those lines
+    union
+    {
+        erow *rows; // NULL while the leaf only has its lines
+        struct
+        {
+            struct rownode *child[ROWTREE_FANOUT];
+            int count[ROWTREE_FANOUT]; // the number of rows under each child
+        } in;
+    } u;
+};
+
 // controlling the cursor, the text, all the property of the application
 struct editorConfig
 {
@@ -94,12 +461,40 @@ struct editorConfig
     int screenrows;
     int screencols;
     int numrows;
-    erow *row;
+    struct rownode *rows;
+    /**
+     * rows [0, hl_valid_rows) have an up-to-date hl_open_comment, the rows
+     * behind it are checked again when they are drawn or searched
+     */
+    int hl_valid_rows;
+    // the opened file is mapped read-only, unedited rows point into it
+    char *map;
+    size_t mapsize;
     int dirty; // if the file has been modified since opening or saving the file
     char *filename;
     char statusmsg[80];
     time_t statusmsg_time;
     struct editorSyntax *syntax;
+    struct hlmatcher hlm;
+    /**
+     * front is what the terminal shows now, back is the frame being drawn,
+     * only the cells that differ between them are written
+     */
+    struct screen front, back;
+    int screen_valid; // 0 if the terminal has to be repainted from scratch
+    int term_cy, term_cx; // where the cursor was left by the last frame
+    // the signal handlers write to sigpipe[1] to wake up the input loop
+    int sigpipe[2];
+    struct inring in;
+    struct search search;
+    struct save save;
+    struct journal journal;
+    struct undo undo;
+    struct slabs slab;
+    // bytes written to the terminal
+    unsigned long frames;
+    int frame_bytes;
+    unsigned long total_bytes;
     struct termios orig_termios;
 };
 
@@ -132,8 +527,23 @@ struct editorSyntax HLDB[] = {
 /* prototypes */
 
 void editorSetStatusMessage(const char *fmt, ...);
+void editorUpdateSyntax(int filerow);
+char *editorRowText(erow *row);
+char *editorRowRender(erow *row);
+void editorSyntaxSync(int at);
+int editorSyntaxFollow(erow *row, int in_comment);
+void editorRowInit(erow *row, char *chars, int len, int flags);
 void editorRefreshScreen();
-char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorScreenResize();
+void editorWaitInput();
+void searchPoll();
+void editorSaveDone();
+void journalRecord(int op, int row, int at, const char *s, int len);
+void undoRecord(int op, int row, int at, const char *s, int len, const char *s2, int len2);
+void journalFlush();
+void journalTick();
+void journalRebase(long long from);
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int empty);
 
 /* terminal */
 
@@ -154,6 +564,9 @@ void die(const char *s)
 
 void disableRawMode()
 {
+    // turn bracketed paste mode off again
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
+
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
         die("tcsetattr");
 }
@@ -199,95 +612,9 @@ void enableRawMode()
     // pending output to be written to the terminal and discards any input that hasn't been read.
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
         die("tcsetattr");
-}
-
-int editorReadKey()
-{
-    int nread;
-    char c;
-
-    // read content byte by byte
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
-    {
-        // errno indicate what erro was
-        if (nread == -1 && errno != EAGAIN)
-            die("read");
-    }
-
-    // if it is <esc>
-    if (c == '\x1b')
-    {
-        char seq[3];
-
-        if (read(STDIN_FILENO, &seq[0], 1) != 1)
-            return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1)
-            return '\x1b';
-
-        if (seq[0] == '[')
-        {
-            if (seq[1] >= '0' && seq[1] <= '9')
-            {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1)
-                    return '\x1b';
-
-                if (seq[2] == '~')
-                {
-                    switch (seq[1])
-                    {
-                    case '1':
-                        return HOME_KEY;
-                    case '3':
-                        return DEL_KEY;
-                    case '4':
-                        return END_KEY;
-                    case '5':
-                        return PAGE_UP;
-                    case '6':
-                        return PAGE_DOWN;
-                    case '7':
-                        return HOME_KEY;
-                    case '8':
-                        return END_KEY;
-                    }
-                }
-            }
-            else
-            {
-                switch (seq[1])
-                {
-                case 'A':
-                    return ARROW_UP;
-                case 'B':
-                    return ARROW_DOWN;
-                case 'C':
-                    return ARROW_RIGHT;
-                case 'D':
-                    return ARROW_LEFT;
-                case 'H':
-                    return HOME_KEY;
-                case 'F':
-                    return END_KEY;
-                }
-            }
-        }
-        else if (seq[0] == 'O')
-        {
-            switch (seq[1])
-            {
-            case 'H':
-                return HOME_KEY;
-            case 'F':
-                return END_KEY;
-            }
-        }
 
-        return '\x1b';
-    }
-    else
-    {
-        return c;
-    }
+    // pasted text comes as <esc>[200~ text <esc>[201~ instead of keypresses
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
 int getCursorPosition(int *rows, int *cols)
@@ -356,676 +683,5062 @@ int getWindowSize(int *rows, int *cols)
     }
 }
 
-/* syntax highlighting */
+void handleSigwinch(int sig)
+{
+    int saved_errno = errno;
 
-int is_separator(int c)
+    (void)sig;
+    write(E.sigpipe[1], "w", 1);
+    errno = saved_errno;
+}
+
+// signals are turned into bytes on a pipe, so poll() can wait for them too
+void enableSignals()
 {
-    return isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL;
+    struct sigaction sa;
+
+    if (pipe(E.sigpipe) == -1)
+        die("pipe");
+
+    fcntl(E.sigpipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(E.sigpipe[1], F_SETFL, O_NONBLOCK);
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handleSigwinch;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+
+    if (sigaction(SIGWINCH, &sa, NULL) == -1)
+        die("sigaction");
 }
 
-/**
- * enhance the highlight
- */
-void editorUpdateSyntax(erow *row)
+// the window was resized, take the new size and repaint everything
+void editorResize()
 {
-    row->hl = realloc(row->hl, row->rsize);
-    memset(row->hl, HL_NORMAL, row->rsize);
+    if (getWindowSize(&E.screenrows, &E.screencols) == -1)
+        die("getWindowSize");
 
-    if(E.syntax == NULL)
-        return;
+    E.screenrows -= 2;
 
-    char **keywords = E.syntax->keywords;
+    if (E.screenrows < 1)
+        E.screenrows = 1;
 
-    char *scs = E.syntax->singleline_comment_start;
-    char *mcs = E.syntax->multiline_comment_start;
-    char *mce = E.syntax->multiline_comment_end;
+    if (E.screencols < 1)
+        E.screencols = 1;
 
-    int scs_len = scs ? strlen(scs) : 0;
-    int mcs_len = mcs ? strlen(mcs) : 0;
-    int mce_len = mce ? strlen(mce) : 0;
+    editorScreenResize();
+}
 
-    // previous seperator
-    int prev_sep = 1;
-    int in_string = 0;
-    int in_comment = (row->idx > 0 && E.row[row->idx - 1].hl_open_comment);
+// milliseconds until the next timer is due, -1 if there is none
+int editorTimeout()
+{
+    // the progress of a search is drawn while it runs
+    if (E.search.running)
+        return KILO_SEARCH_TICK;
 
-    int i = 0;
-    while(i < row->rsize)
+    // the journal is synced a little after the last edit
+    if (E.journal.unsynced)
     {
-        char c = row->render[i];
-        unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
+        time_t left = E.journal.due - time(NULL);
 
-        if(scs_len && !in_string && !in_comment)
-        {
-            // check whether start as "//"
-            if(!strncmp(&row->render[i], scs, scs_len))
-            {
-                // set color for the rest of the line
-                memset(&row->hl[i], HL_COMMENT, row->rsize - i);
-                break;
-            }
-        }
+        return left > 0 ? left * 1000 : 0;
+    }
 
-        if(mcs_len && mce_len && !in_string)
-        {
-            if(in_comment)
-            {
-                row->hl[i] = HL_MLCOMMENT;
-                if(!strncmp(&row->render[i], mce, mce_len))
-                {
-                    memset(&row->hl[i], HL_MLCOMMENT, mce_len);
-                    i += mce_len;
-                    in_comment = 0;
-                    prev_sep = 1;
+    // the status message disappears KILO_MSG_TIMEOUT seconds after it is set
+    if (E.statusmsg[0])
+    {
+        time_t left = E.statusmsg_time + KILO_MSG_TIMEOUT - time(NULL);
 
-                    continue;
-                }
-                else
-                {
-                    i++;
+        if (left > 0)
+            return left * 1000;
+    }
 
-                    continue;
-                }
-            }
-            else if(!strncmp(&row->render[i], mcs, mcs_len))
-            {
-                memset(&row->hl[i], HL_MLCOMMENT, mcs_len);
-                i += mcs_len;
-                in_comment = 1;
+    return -1;
+}
+
+/**
+ * block until stdin has input, a resize or a timer in the meantime only
+ * refreshes the screen
+ */
+void editorWaitInput()
+{
+    while (1)
+    {
+        journalTick();
 
+        // poll() skips the save pipe while it is -1
+        struct pollfd fds[3] = {
+            {STDIN_FILENO, POLLIN, 0},
+            {E.sigpipe[0], POLLIN, 0},
+            {E.save.fd, POLLIN, 0},
+        };
+        int n = poll(fds, 3, editorTimeout());
+
+        if (n == -1)
+        {
+            if (errno == EINTR)
                 continue;
-            }
+            die("poll");
         }
 
-        if(E.syntax->flags & HL_HIGHLIGHT_STRING)
+        if (fds[1].revents & POLLIN)
         {
-            if(in_string)
-            {
-                row->hl[i] = HL_STRING;
-
-                if(c == '\\' && i + 1 < row->rsize)
-                {
-                    row->hl[i + 1] = HL_STRING;
-                    i += 2;
-                    continue;
-                }
-
-                // whether the current character is the closing quote
-                if(c == in_string)
-                    in_string = 0;
+            char buf[64];
+            int resized = 0, searched = 0;
+            ssize_t len;
 
-                i++;
-                /**
-                 * if we're done highlighting the string, the closing quote
-                 * is considered a separator
-                 */
-                prev_sep = 1;
-                continue;
-            }
-            else
+            // 'w' for a resize, 's' for a search thread that is done
+            while ((len = read(E.sigpipe[0], buf, sizeof(buf))) > 0)
             {
-                // check is the beginning of one by checking for a double- or single-quote
-                if(c == '"' || c == '\'')
-                {
-                    in_string = c;
-                    row->hl[i] = HL_STRING;
-                    i++;
-                    continue;
-                }
+                resized |= memchr(buf, 'w', len) != NULL;
+                searched |= memchr(buf, 's', len) != NULL;
             }
-        }
 
-        if(E.syntax->flags & HL_HIGHLIGHT_NUMBERS)
-        {
-            // support decimal points
-            if((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
-               (c == '.' && prev_hl == HL_NUMBER))
-            {
-                row->hl[i] = HL_NUMBER;
-                i++;
-                prev_sep = 0;
+            if (resized)
+                editorResize();
 
-                continue;
-            }
+            if (searched)
+                searchPoll();
         }
 
-        if(prev_sep)
-        {
-            int j;
+        if (fds[2].revents)
+            editorSaveDone();
 
-            for(j = 0; keywords[j]; j++)
-            {
-                int klen = strlen(keywords[j]);
-                // check whether is secondary keyword
-                int kw2 = keywords[j][klen - 1] == '|';
+        if (fds[0].revents)
+            return;
 
-                if(kw2)
-                    klen--;
+        editorRefreshScreen();
+    }
+}
 
-                if(!strncmp(&row->render[i], keywords[j], klen) &&
-                   is_separator(row->render[i + klen]))
-                {
-                    memset(&row->hl[i], kw2 ? HL_KEYWORD2 : HL_KEYWORD1, klen);
-                    i += klen;
+/* input reader */
 
-                    break;
-                }
-            }
+#define INRING_LEN() (E.in.tail - E.in.head)
+#define INRING_AT(i) (E.in.buf[(E.in.head + (i)) & (KILO_INPUT_SIZE - 1)])
 
-            if(keywords[j] != NULL)
-            {
-                prev_sep = 0;
-                continue;
+/**
+ * read everything stdin has into the ring with one readv(), after waiting up
+ * to timeout ms for it (-1 to wait for good), returns the bytes read
+ */
+int inputFill(int timeout)
+{
+    unsigned int len = INRING_LEN();
+    unsigned int start = E.in.tail & (KILO_INPUT_SIZE - 1);
+    struct iovec iov[2];
+    int iovcnt = 1;
+
+    if (len == KILO_INPUT_SIZE)
+        return 0;
+
+    if (timeout < 0)
+    {
+        editorWaitInput();
+    }
+    else
+    {
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+
+        if (poll(&pfd, 1, timeout) <= 0)
+            return 0;
+    }
+
+    // the free space may wrap around the end of buf
+    iov[0].iov_base = &E.in.buf[start];
+    iov[0].iov_len = KILO_INPUT_SIZE - len;
+
+    if (start + (KILO_INPUT_SIZE - len) > KILO_INPUT_SIZE)
+    {
+        iov[0].iov_len = KILO_INPUT_SIZE - start;
+        iov[1].iov_base = E.in.buf;
+        iov[1].iov_len = (KILO_INPUT_SIZE - len) - iov[0].iov_len;
+        iovcnt = 2;
+    }
+
+    ssize_t nread = readv(STDIN_FILENO, iov, iovcnt);
+
+    if (nread == -1)
+    {
+        // errno indicate what erro was
+        if (errno != EAGAIN && errno != EINTR)
+            die("read");
+        return 0;
+    }
+
+    E.in.tail += nread;
+    return nread;
+}
+
+enum inputState
+{
+    IN_GROUND = 0,
+    IN_ESC,   // after <esc>
+    IN_SS3,   // after <esc>O
+    IN_CSI    // after <esc>[, in the parameters
+};
+
+// the key of the final byte of <esc>[<param><final>
+int inputCSIKey(int param, int final)
+{
+    if (final == '~')
+    {
+        switch (param)
+        {
+        case 1:
+        case 7:
+            return HOME_KEY;
+        case 3:
+            return DEL_KEY;
+        case 4:
+        case 8:
+            return END_KEY;
+        case 5:
+            return PAGE_UP;
+        case 6:
+            return PAGE_DOWN;
+        case 200:
+            return PASTE_START;
+        case 201:
+            return PASTE_END;
+        }
+
+        return '\x1b';
+    }
+
+    switch (final)
+    {
+    case 'A':
+        return ARROW_UP;
+    case 'B':
+        return ARROW_DOWN;
+    case 'C':
+        return ARROW_RIGHT;
+    case 'D':
+        return ARROW_LEFT;
+    case 'H':
+        return HOME_KEY;
+    case 'F':
+        return END_KEY;
+    }
+
+    return '\x1b';
+}
+
+/**
+ * decode the key at the head of the ring, returns the bytes it takes or 0 if
+ * the ring ends in the middle of an escape sequence. A sequence we don't know
+ * is swallowed whole and reads as a lone <esc>
+ */
+int inputDecode(int *key)
+{
+    enum inputState state = IN_GROUND;
+    unsigned int len = INRING_LEN();
+    unsigned int i;
+    int param = 0, more = 0;
+
+    for (i = 0; i < len; i++)
+    {
+        int c = INRING_AT(i);
+
+        switch (state)
+        {
+        case IN_GROUND:
+            if (c != '\x1b')
+            {
+                *key = c;
+                return 1;
+            }
+            state = IN_ESC;
+            break;
+
+        case IN_ESC:
+            if (c == '[')
+            {
+                state = IN_CSI;
+            }
+            else if (c == 'O')
+            {
+                state = IN_SS3;
+            }
+            else
+            {
+                // the next byte is a key of its own
+                *key = '\x1b';
+                return 1;
+            }
+            break;
+
+        case IN_SS3:
+            *key = (c == 'H' || c == 'F') ? inputCSIKey(0, c) : '\x1b';
+            return i + 1;
+
+        case IN_CSI:
+            if (c >= '0' && c <= '9')
+            {
+                // only the first parameter matters, modifiers are ignored
+                if (!more && param < 10000)
+                    param = param * 10 + c - '0';
+            }
+            else if (c == ';')
+            {
+                more = 1;
+            }
+            else if (c >= 0x40 && c <= 0x7e)
+            {
+                *key = inputCSIKey(param, c);
+                return i + 1;
+            }
+            else if (c < 0x20 || c > 0x3f)
+            {
+                *key = '\x1b';
+                return 1;
+            }
+            break;
+        }
+    }
+
+    return 0;
+}
+
+int editorReadKey()
+{
+    int key;
+
+    while (1)
+    {
+        int n = inputDecode(&key);
+
+        if (n > 0)
+        {
+            E.in.head += n;
+            return key;
+        }
+
+        if (INRING_LEN() == 0)
+        {
+            // sleep until there is something to read
+            inputFill(-1);
+        }
+        else if (INRING_LEN() == KILO_INPUT_SIZE || !inputFill(KILO_ESC_TIMEOUT))
+        {
+            // the rest of the escape sequence never came, it is just <esc>
+            E.in.head++;
+            return '\x1b';
+        }
+    }
+}
+
+// whether a key can be read without waiting
+int editorKeyPending()
+{
+    if (INRING_LEN() == 0)
+        inputFill(0);
+
+    return INRING_LEN() != 0;
+}
+
+/* slab */
+
+/**
+ * Rows take their text, render and hl spans from slabs instead of malloc().
+ * A slab is a size class, its pieces are carved from big chunks, and a freed
+ * piece goes on the free list of its class for the next row of that size.
+ * The class is in the byte in front of a piece, that's all the overhead a
+ * row buffer has. The chunks are never freed, the buffer lives as long as
+ * the process, and they all go back at once when it exits. Nothing in the
+ * slabs is aligned, the hl spans copy their columns in and out.
+ */
+
+// the bytes of a piece of class c, 8 byte steps up to 128, then 4 per doubling
+int slabClassSize(int c)
+{
+    if (c < 15)
+        return (c + 2) * 8;
+
+    c -= 15;
+    return (128 << (c / 4)) + (32 << (c / 4)) * (c % 4 + 1);
+}
+
+// the smallest class with n bytes
+int slabClass(int n)
+{
+    int c;
+
+    if (n <= 128)
+        return n <= 16 ? 0 : (n + 7) / 8 - 2;
+
+    for (c = 15; c < SLAB_CLASSES; c += 4)
+        if (n <= slabClassSize(c + 3))
+            break;
+
+    if (c >= SLAB_CLASSES)
+        return SLAB_BIG;
+
+    while (n > slabClassSize(c))
+        c++;
+
+    return c;
+}
+
+void *slabAlloc(int n)
+{
+    int c = slabClass(n + 1);
+    char *b;
+
+    if (c == SLAB_BIG)
+    {
+        b = malloc(n + 1);
+    }
+    else if (E.slab.free[c])
+    {
+        b = E.slab.free[c];
+        memcpy(&E.slab.free[c], b + 1, sizeof(char *));
+    }
+    else
+    {
+        int size = slabClassSize(c);
+
+        // the rest of a chunk too small for this piece is left unused
+        if (E.slab.left < size)
+        {
+            E.slab.chunk = malloc(KILO_SLAB_CHUNK);
+            E.slab.left = KILO_SLAB_CHUNK;
+        }
+
+        b = E.slab.chunk;
+        E.slab.chunk += size;
+        E.slab.left -= size;
+    }
+
+    b[0] = c;
+    return b + 1;
+}
+
+void slabFree(void *p)
+{
+    char *b;
+    int c;
+
+    if (p == NULL)
+        return;
+
+    b = (char *)p - 1;
+    c = (unsigned char)b[0];
+
+    if (c == SLAB_BIG)
+    {
+        free(b);
+        return;
+    }
+
+    memcpy(b + 1, &E.slab.free[c], sizeof(char *));
+    E.slab.free[c] = b;
+}
+
+// like realloc(), a piece that is still the right class stays where it is
+void *slabRealloc(void *p, int n)
+{
+    char *b;
+    int c, to = slabClass(n + 1);
+
+    if (p == NULL)
+        return slabAlloc(n);
+
+    b = (char *)p - 1;
+    c = (unsigned char)b[0];
+
+    if (c == to)
+    {
+        if (c != SLAB_BIG)
+            return p;
+
+        b = realloc(b, n + 1);
+        return b + 1;
+    }
+
+    char *q = slabAlloc(n);
+    int old = c == SLAB_BIG ? n : slabClassSize(c) - 1;
+
+    memcpy(q, p, old < n ? old : n);
+    slabFree(p);
+
+    return q;
+}
+
+/* row tree */
+
+/**
+ * The rows live in a counted B+ tree instead of one flat array. Every inner
+ * node remembers how many rows are under each child, so finding, inserting
+ * or deleting the row with a given index only walks one path from the root,
+ * which is O(log n) instead of moving all the rows behind it.
+ * The leaves are linked, so walking the rows in order doesn't need a lookup
+ * for each of them.
+ */
+struct rownode *rowNodeNew(int leaf)
+{
+    struct rownode *node = calloc(1, sizeof(struct rownode));
+
+    if (node == NULL)
+        die("calloc");
+
+    node->leaf = leaf;
+
+    if (leaf && (node->u.rows = malloc(sizeof(erow) * ROWTREE_FANOUT)) == NULL)
+        die("malloc");
+
+    return node;
+}
+
+// a leaf holding the lines of the map starting at base, without rows yet
+struct rownode *rowNodeMapped(char *base)
+{
+    struct rownode *node = calloc(1, sizeof(struct rownode));
+
+    if (node == NULL || (node->lines = malloc(sizeof(int) * (ROWTREE_FANOUT + 1))) == NULL)
+        die("malloc");
+
+    node->leaf = 1;
+    node->base = base;
+    node->lines[0] = 0;
+    node->hl_in_comment = -1;
+
+    return node;
+}
+
+void rowNodeFree(struct rownode *node)
+{
+    if (node->leaf)
+    {
+        free(node->u.rows);
+        free(node->lines);
+    }
+
+    free(node);
+}
+
+// the line "i" of a leaf as a row pointing into the map
+void rowLineInit(struct rownode *leaf, int i, erow *row)
+{
+    char *p = leaf->base + leaf->lines[i];
+    int len = leaf->lines[i + 1] - leaf->lines[i];
+
+    if (len > 0 && p[len - 1] == '\n')
+        len--;
+
+    // truncate the \r\n
+    while (len > 0 && p[len - 1] == '\r')
+        len--;
+
+    editorRowInit(row, p, len, ROW_MAPPED);
+}
+
+/**
+ * the rows of a leaf, made from its lines the first time. Only the main
+ * thread makes them; the search threads may still read the lines, so those
+ * are dropped once no search is running.
+ */
+erow *rowLeafRows(struct rownode *leaf)
+{
+    erow *rows = leaf->u.rows;
+
+    if (rows == NULL)
+    {
+        int in_comment = leaf->hl_in_comment;
+
+        if ((rows = malloc(sizeof(erow) * ROWTREE_FANOUT)) == NULL)
+            die("malloc");
+
+        for (int i = 0; i < leaf->n; i++)
+        {
+            rowLineInit(leaf, i, &rows[i]);
+
+            // the state the lines were followed with stays good for the rows
+            if (in_comment != -1)
+            {
+                rows[i].hl_in_comment = in_comment;
+                in_comment = rows[i].hl_open_comment = editorSyntaxFollow(&rows[i], in_comment);
+            }
+        }
+
+        __atomic_store_n(&leaf->u.rows, rows, __ATOMIC_RELEASE);
+    }
+
+    if (leaf->lines && !E.search.running)
+    {
+        free(leaf->lines);
+        leaf->lines = NULL;
+    }
+
+    return rows;
+}
+
+/**
+ * the row "pos" of a leaf without making the rows, for the search threads
+ * and the save child. It's built in tmp when the leaf only has its lines.
+ */
+erow *rowLeafPeek(struct rownode *leaf, int pos, erow *tmp)
+{
+    erow *rows = __atomic_load_n(&leaf->u.rows, __ATOMIC_ACQUIRE);
+
+    if (rows)
+        return &rows[pos];
+
+    rowLineInit(leaf, pos, tmp);
+
+    return tmp;
+}
+
+// the number of rows under a node
+int rowNodeCount(struct rownode *node)
+{
+    if (node->leaf)
+        return node->n;
+
+    int count = 0;
+
+    for (int i = 0; i < node->n; i++)
+        count += node->u.in.count[i];
+
+    return count;
+}
+
+// copy "k" entries from src[s] to dst[d], the ranges may overlap
+void rowNodeCopy(struct rownode *dst, int d, struct rownode *src, int s, int k)
+{
+    if (k <= 0)
+        return;
+
+    if (dst->leaf)
+    {
+        memmove(&dst->u.rows[d], &src->u.rows[s], sizeof(erow) * k);
+    }
+    else
+    {
+        memmove(&dst->u.in.child[d], &src->u.in.child[s], sizeof(struct rownode *) * k);
+        memmove(&dst->u.in.count[d], &src->u.in.count[s], sizeof(int) * k);
+    }
+}
+
+/**
+ * split a full node into two and return the new right one. When the new entry
+ * goes to the end of the node, the node is kept full, so appending rows one
+ * by one, like loading a file, doesn't leave half empty leaves behind.
+ */
+struct rownode *rowNodeSplit(struct rownode *node, int pos)
+{
+    struct rownode *right = rowNodeNew(node->leaf);
+    int mid = (pos == node->n) ? node->n : node->n / 2;
+
+    rowNodeCopy(right, 0, node, mid, node->n - mid);
+    right->n = node->n - mid;
+    node->n = mid;
+
+    if (node->leaf)
+    {
+        right->next = node->next;
+        right->prev = node;
+
+        if (node->next)
+            node->next->prev = right;
+
+        node->next = right;
+    }
+
+    return right;
+}
+
+/**
+ * make room for the row "at" under the node and store the address of the new
+ * entry in slot. Returns the new right sibling when the node had to be split.
+ */
+struct rownode *rowNodeInsert(struct rownode *node, int at, erow **slot)
+{
+    struct rownode *right = NULL;
+
+    if (node->leaf)
+    {
+        rowLeafRows(node);
+
+        if (node->n == ROWTREE_FANOUT)
+        {
+            right = rowNodeSplit(node, at);
+
+            if (at > node->n || node->n == ROWTREE_FANOUT)
+            {
+                at -= node->n;
+                node = right;
+            }
+        }
+
+        rowNodeCopy(node, at + 1, node, at, node->n - at);
+        node->n++;
+        *slot = &node->u.rows[at];
+
+        return right;
+    }
+
+    // find the child holding the row, appending goes to the last child
+    int i = 0;
+    while (i < node->n - 1 && at > node->u.in.count[i])
+    {
+        at -= node->u.in.count[i];
+        i++;
+    }
+
+    struct rownode *child = node->u.in.child[i];
+    struct rownode *split = rowNodeInsert(child, at, slot);
+
+    if (split == NULL)
+    {
+        node->u.in.count[i]++;
+
+        return NULL;
+    }
+
+    node->u.in.count[i] = rowNodeCount(child);
+
+    // hook the new child next to the one which was split
+    struct rownode *parent = node;
+    int pos = i + 1;
+
+    if (node->n == ROWTREE_FANOUT)
+    {
+        right = rowNodeSplit(node, pos);
+
+        if (pos > node->n || node->n == ROWTREE_FANOUT)
+        {
+            pos -= node->n;
+            parent = right;
+        }
+    }
+
+    rowNodeCopy(parent, pos + 1, parent, pos, parent->n - pos);
+    parent->u.in.child[pos] = split;
+    parent->u.in.count[pos] = rowNodeCount(split);
+    parent->n++;
+
+    return right;
+}
+
+// merge two neighbour children of a node or share their entries evenly
+void rowNodeBalance(struct rownode *node, int i)
+{
+    struct rownode *a = node->u.in.child[i];
+    struct rownode *b = node->u.in.child[i + 1];
+    int total = a->n + b->n;
+
+    if (a->leaf)
+    {
+        rowLeafRows(a);
+        rowLeafRows(b);
+    }
+
+    if (total <= ROWTREE_FANOUT)
+    {
+        rowNodeCopy(a, a->n, b, 0, b->n);
+        a->n = total;
+
+        if (a->leaf)
+        {
+            a->next = b->next;
+
+            if (b->next)
+                b->next->prev = a;
+        }
+
+        rowNodeFree(b);
+
+        node->u.in.count[i] += node->u.in.count[i + 1];
+        rowNodeCopy(node, i + 1, node, i + 2, node->n - i - 2);
+        node->n--;
+
+        return;
+    }
+
+    int k = a->n - total / 2;
+
+    if (k > 0)
+    {
+        // move the last k entries of a to the front of b
+        rowNodeCopy(b, k, b, 0, b->n);
+        rowNodeCopy(b, 0, a, a->n - k, k);
+        a->n -= k;
+        b->n += k;
+    }
+    else
+    {
+        // move the first entries of b to the end of a
+        k = -k;
+        rowNodeCopy(a, a->n, b, 0, k);
+        rowNodeCopy(b, 0, b, k, b->n - k);
+        a->n += k;
+        b->n -= k;
+    }
+
+    node->u.in.count[i] = rowNodeCount(a);
+    node->u.in.count[i + 1] = rowNodeCount(b);
+}
+
+void rowNodeDelete(struct rownode *node, int at)
+{
+    if (node->leaf)
+    {
+        rowLeafRows(node);
+        rowNodeCopy(node, at, node, at + 1, node->n - at - 1);
+        node->n--;
+
+        return;
+    }
+
+    int i = 0;
+    while (at >= node->u.in.count[i])
+    {
+        at -= node->u.in.count[i];
+        i++;
+    }
+
+    struct rownode *child = node->u.in.child[i];
+
+    rowNodeDelete(child, at);
+    node->u.in.count[i]--;
+
+    // keep the children at least a quarter full
+    if (child->n < ROWTREE_FANOUT / 4 && node->n > 1)
+        rowNodeBalance(node, (i + 1 < node->n) ? i : i - 1);
+}
+
+// find the leaf holding the row "at" and the position of the row in it
+struct rownode *rowTreeFind(int at, int *pos)
+{
+    struct rownode *node = E.rows;
+
+    while (!node->leaf)
+    {
+        int i = 0;
+        while (i < node->n - 1 && at >= node->u.in.count[i])
+        {
+            at -= node->u.in.count[i];
+            i++;
+        }
+
+        node = node->u.in.child[i];
+    }
+
+    *pos = at;
+
+    return node;
+}
+
+erow *editorRowAt(int at)
+{
+    int pos;
+    struct rownode *leaf = rowTreeFind(at, &pos);
+
+    return &rowLeafRows(leaf)[pos];
+}
+
+// add an uninitialized row at index "at", the caller fills it in
+erow *rowTreeInsert(int at)
+{
+    erow *slot;
+    struct rownode *right = rowNodeInsert(E.rows, at, &slot);
+
+    // the root was split, the tree grows by one level
+    if (right)
+    {
+        struct rownode *root = rowNodeNew(0);
+
+        root->u.in.child[0] = E.rows;
+        root->u.in.count[0] = rowNodeCount(E.rows);
+        root->u.in.child[1] = right;
+        root->u.in.count[1] = rowNodeCount(right);
+        root->n = 2;
+        E.rows = root;
+    }
+
+    E.numrows++;
+
+    return slot;
+}
+
+// remove the row "at" from the tree, the caller frees its content
+void rowTreeDelete(int at)
+{
+    rowNodeDelete(E.rows, at);
+
+    // the tree shrinks by one level when the root has a single child left
+    while (!E.rows->leaf && E.rows->n == 1)
+    {
+        struct rownode *root = E.rows;
+
+        E.rows = root->u.in.child[0];
+        free(root);
+    }
+
+    E.numrows--;
+}
+
+/* syntax highlighting */
+
+int is_separator(int c)
+{
+    return E.hlm.cclass[(unsigned char)c] & CC_SEPARATOR;
+}
+
+/**
+ * build the character classes and the keyword trie of E.syntax, it's done
+ * once when the syntax is selected instead of at every separator
+ */
+void editorSyntaxCompile()
+{
+    struct hlmatcher *m = &E.hlm;
+    int c, j;
+
+    free(m->next);
+    free(m->kw);
+    free(m->kwhl);
+    memset(m, 0, sizeof(*m));
+
+    for(c = 0; c < 256; c++)
+    {
+        if(isspace(c) || c == '\0' || strchr(",.()+-/*=~%<>[];", c) != NULL)
+            m->cclass[c] |= CC_SEPARATOR;
+
+        if(isdigit(c))
+            m->cclass[c] |= CC_DIGIT;
+    }
+
+    if(E.syntax == NULL)
+        return;
+
+    char **keywords = E.syntax->keywords;
+    char *scs = E.syntax->singleline_comment_start;
+    char *mcs = E.syntax->multiline_comment_start;
+    char *mce = E.syntax->multiline_comment_end;
+
+    m->scs_len = scs ? strlen(scs) : 0;
+    m->mcs_len = mcs ? strlen(mcs) : 0;
+    m->mce_len = mce ? strlen(mce) : 0;
+
+    m->lookahead = 2;
+    if(m->scs_len > m->lookahead)
+        m->lookahead = m->scs_len;
+    if(m->mcs_len > m->lookahead)
+        m->lookahead = m->mcs_len;
+    if(m->mce_len > m->lookahead)
+        m->lookahead = m->mce_len;
+
+    // give every char used by a keyword an index, 0 means no child
+    int nodes = 1;
+    m->nalpha = 1;
+
+    for(j = 0; keywords[j]; j++)
+    {
+        int klen = strlen(keywords[j]);
+
+        // the keyword and the separator behind it
+        if(klen + 1 > m->lookahead)
+            m->lookahead = klen + 1;
+
+        if(keywords[j][klen - 1] == '|')
+            klen--;
+
+        for(int k = 0; k < klen; k++)
+        {
+            unsigned char ch = keywords[j][k];
+
+            if(!m->alpha[ch])
+                m->alpha[ch] = m->nalpha++;
+        }
+
+        m->cclass[(unsigned char)keywords[j][0]] |= CC_KEYWORD;
+        nodes += klen;
+    }
+
+    m->next = calloc(nodes * m->nalpha, sizeof(int));
+    m->kw = malloc(sizeof(int) * nodes);
+    m->kwhl = malloc(nodes);
+
+    for(j = 0; j < nodes; j++)
+        m->kw[j] = -1;
+
+    int used = 1;
+
+    for(j = 0; keywords[j]; j++)
+    {
+        int klen = strlen(keywords[j]);
+        // check whether is secondary keyword
+        int kw2 = keywords[j][klen - 1] == '|';
+        int node = 0;
+
+        if(kw2)
+            klen--;
+
+        for(int k = 0; k < klen; k++)
+        {
+            int *child = &m->next[node * m->nalpha + m->alpha[(unsigned char)keywords[j][k]]];
+
+            if(*child == 0)
+                *child = used++;
+
+            node = *child;
+        }
+
+        // the first of two equal keywords wins, like the list order did
+        if(m->kw[node] == -1)
+        {
+            m->kw[node] = j;
+            m->kwhl[node] = kw2 ? HL_KEYWORD2 : HL_KEYWORD1;
+        }
+    }
+}
+
+/**
+ * find the keyword at the start of s, which must be followed by a separator.
+ * Returns its highlight and stores its length in klen, or returns 0.
+ * When several keywords match, the first one in the list is taken.
+ */
+int editorSyntaxKeyword(const char *s, int len, int *klen)
+{
+    struct hlmatcher *m = &E.hlm;
+    int node = 0;
+    int best = -1;
+    int hl = 0;
+
+    for(int j = 0; j < len; j++)
+    {
+        int a = m->alpha[(unsigned char)s[j]];
+
+        if(a == 0 || (node = m->next[node * m->nalpha + a]) == 0)
+            break;
+
+        if(m->kw[node] != -1 && (best == -1 || m->kw[node] < best) &&
+           (j + 1 == len || is_separator(s[j + 1])))
+        {
+            best = m->kw[node];
+            hl = m->kwhl[node];
+            *klen = j + 1;
+        }
+    }
+
+    return hl;
+}
+
+// store the comment state at the end of the row
+void editorSyntaxSetState(int filerow, erow *row, int in_comment)
+{
+    int changed = (row->hl_open_comment != in_comment);
+
+    row->hl_open_comment = in_comment;
+
+    /**
+     * the rows below are not highlighted again right away, they only stop
+     * being trusted. editorSyntaxSync() catches up with them once they are
+     * needed, and stops highlighting as soon as a row gets the same state it
+     * was highlighted with before.
+     */
+    if(filerow == E.hl_valid_rows)
+        E.hl_valid_rows++;
+    else if(changed && filerow < E.hl_valid_rows)
+        E.hl_valid_rows = filerow + 1;
+}
+
+/**
+ * only follow the strings and the comments of a row which is not rendered
+ * yet, without allocating anything, and return the state at its end. The
+ * chars may point into the mapped file, so they are not terminated by '\0'
+ */
+int editorSyntaxFollow(erow *row, int in_comment)
+{
+    if(E.syntax == NULL)
+        return 0;
+
+    char *scs = E.syntax->singleline_comment_start;
+    char *mcs = E.syntax->multiline_comment_start;
+    char *mce = E.syntax->multiline_comment_end;
+
+    int scs_len = E.hlm.scs_len;
+    int mcs_len = E.hlm.mcs_len;
+    int mce_len = E.hlm.mce_len;
+
+    char *s = editorRowText(row);
+    int in_string = 0;
+
+    int i = 0;
+    while(i < row->size)
+    {
+        if(scs_len && !in_string && !in_comment &&
+           i + scs_len <= row->size && !memcmp(&s[i], scs, scs_len))
+            break;
+
+        if(mcs_len && mce_len && !in_string)
+        {
+            if(in_comment)
+            {
+                if(i + mce_len <= row->size && !memcmp(&s[i], mce, mce_len))
+                {
+                    i += mce_len;
+                    in_comment = 0;
+                }
+                else
+                {
+                    i++;
+                }
+
+                continue;
+            }
+            else if(i + mcs_len <= row->size && !memcmp(&s[i], mcs, mcs_len))
+            {
+                i += mcs_len;
+                in_comment = 1;
+
+                continue;
+            }
+        }
+
+        if(E.syntax->flags & HL_HIGHLIGHT_STRING)
+        {
+            if(in_string)
+            {
+                if(s[i] == '\\' && i + 1 < row->size)
+                {
+                    i += 2;
+                    continue;
+                }
+
+                if(s[i] == in_string)
+                    in_string = 0;
+            }
+            else if(s[i] == '"' || s[i] == '\'')
+            {
+                in_string = s[i];
+            }
+        }
+
+        i++;
+    }
+
+    return in_comment;
+}
+
+void editorSyntaxUpdateState(int filerow, erow *row, int in_comment)
+{
+    row->hl_in_comment = in_comment;
+
+    editorSyntaxSetState(filerow, row, editorSyntaxFollow(row, in_comment));
+}
+
+// the column span k of the row starts at
+int editorHlStart(erow *row, int k)
+{
+    int start;
+
+    memcpy(&start, HL_SPAN(row, k), sizeof(int));
+    return start;
+}
+
+void editorHlSetStart(erow *row, int k, int start)
+{
+    memcpy(HL_SPAN(row, k), &start, sizeof(int));
+}
+
+// the index of the span column "at" is in, -1 when there is none
+int editorHlSpanAt(erow *row, int at)
+{
+    int lo = 0, hi = row->hl_n;
+
+    while(lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if(editorHlStart(row, mid) <= at)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo - 1;
+}
+
+int editorHlAt(erow *row, int at)
+{
+    int k = editorHlSpanAt(row, at);
+
+    return (k < 0) ? HL_NORMAL : HL_SPAN_HL(row, k);
+}
+
+/**
+ * move the spans behind the edit after the "del" columns at "at" were
+ * replaced by "ins" new ones. The spans which started in the removed
+ * columns are gone but the last one, it starts at "at" now. The span
+ * around the edit is highlighted again anyway.
+ */
+void editorHlShift(erow *row, int at, int del, int ins)
+{
+    int delta = ins - del;
+    int end = at + del;
+    int j, k;
+
+    if(delta == 0 && del == 0)
+        return;
+
+    if(del == 0)
+    {
+        // the first span always starts at 0
+        for(j = row->hl_n - 1; j > 0 && editorHlStart(row, j) >= at; j--)
+            editorHlSetStart(row, j, editorHlStart(row, j) + delta);
+
+        return;
+    }
+
+    for(j = k = 0; j < row->hl_n; j++)
+    {
+        int start = editorHlStart(row, j);
+
+        if(start >= end)
+            start += delta;
+        else if(start > at)
+            start = at;
+
+        if(k > 0 && editorHlStart(row, k - 1) == start)
+            k--;
+
+        editorHlSetStart(row, k, start);
+        HL_SPAN_HL(row, k) = HL_SPAN_HL(row, j);
+        k++;
+    }
+
+    row->hl_n = k;
+}
+
+/**
+ * put the highlight of the columns [from, to) in hl, one byte each, into the
+ * spans of the row. The spans before and behind them stay as they are, and
+ * two spans next to each other never have the same highlight.
+ */
+void editorHlSplice(erow *row, unsigned char *hl, int from, int to)
+{
+    static unsigned char *run = NULL;
+    static int runcap = 0;
+    int m = 0;
+    int j;
+
+    if(row->hl_n == 0)
+    {
+        row->hl = slabRealloc(row->hl, HL_SPAN_SIZE);
+        row->hl_n = 1;
+        editorHlSetStart(row, 0, 0);
+        HL_SPAN_HL(row, 0) = HL_NORMAL;
+    }
+
+    int n = row->hl_n;
+    // the spans before "from" are kept, the one "to" is in goes on behind the new ones
+    int p = editorHlSpanAt(row, from - 1) + 1;
+    int q = (to < row->rsize) ? editorHlSpanAt(row, to) : n - 1;
+    int prev = (p > 0) ? HL_SPAN_HL(row, p - 1) : -1;
+
+    for(j = from; j < to || (j == to && to < row->rsize); j++)
+    {
+        int c = (j < to) ? hl[j] : HL_SPAN_HL(row, q);
+
+        if(c == prev)
+            continue;
+
+        if(m == runcap)
+        {
+            runcap = runcap ? runcap * 2 : 16;
+            run = realloc(run, HL_SPAN_SIZE * runcap);
+        }
+
+        memcpy(&run[m * HL_SPAN_SIZE], &j, sizeof(int));
+        run[m * HL_SPAN_SIZE + sizeof(int)] = c;
+        m++;
+        prev = c;
+    }
+
+    int rest = n - q - 1;
+    int total = p + m + rest;
+
+    if(total > n)
+        row->hl = slabRealloc(row->hl, HL_SPAN_SIZE * total);
+
+    memmove(HL_SPAN(row, p + m), HL_SPAN(row, q + 1), HL_SPAN_SIZE * rest);
+    // run is still NULL when no span was ever made
+    if(m)
+        memcpy(HL_SPAN(row, p), run, HL_SPAN_SIZE * m);
+    row->hl_n = total;
+
+    if(total < n)
+        row->hl = slabRealloc(row->hl, HL_SPAN_SIZE * total);
+}
+
+/**
+ * enhance the highlight
+ *
+ * run the highlighter over the row again after the "del" columns at "at"
+ * were replaced by "ins" new ones. The caller already moved the
+ * rest of render and the hl spans, so only the span from the last checkpoint
+ * far enough before the edit is highlighted again, until the state is the
+ * same as at one of the old checkpoints behind the edit. From there on
+ * nothing changes. The span is highlighted one byte a column in a buffer
+ * all rows share, and then put into the spans of the row.
+ */
+void editorHighlight(int filerow, erow *row, int in_comment, int at, int del, int ins)
+{
+    int delta = ins - del;
+    char *scs = E.syntax->singleline_comment_start;
+    char *mcs = E.syntax->multiline_comment_start;
+    char *mce = E.syntax->multiline_comment_end;
+
+    int scs_len = E.hlm.scs_len;
+    int mcs_len = E.hlm.mcs_len;
+    int mce_len = E.hlm.mce_len;
+
+    /**
+     * a step of the highlighter looks at most this many columns ahead, the
+     * steps which start further before the edit can't see it
+     */
+    int lookahead = E.hlm.lookahead;
+    int j;
+
+    char *render = editorRowRender(row);
+    struct hlstate *cp = row->hl_cp;
+    int ncp = row->hl_ncp;
+
+    // restart from the last checkpoint which can't see the edit
+    int r = ncp - 1;
+    while(r >= 0 && cp[r].pos > at - lookahead)
+        r--;
+
+    int i = 0;
+    int prev_sep = 1;
+    int in_string = 0;
+
+    row->hl_in_comment = in_comment;
+
+    if(r >= 0)
+    {
+        i = cp[r].pos;
+        prev_sep = cp[r].prev_sep;
+        in_string = cp[r].in_string;
+        in_comment = cp[r].in_comment;
+    }
+
+    static unsigned char *hl = NULL;
+    static int hlcap = 0;
+    int from = i;
+
+    if(row->rsize > hlcap)
+    {
+        hlcap = row->rsize;
+        hl = realloc(hl, hlcap);
+    }
+
+    // a number goes on from the column before the span
+    if(i > 0)
+        hl[i - 1] = editorHlAt(row, i - 1);
+
+    // the old checkpoints behind the edit are where the highlighting may stop
+    int k = r + 1;
+    while(k < ncp && cp[k].pos < at + del)
+        k++;
+
+    // the new checkpoints of the span are collected here first
+    static struct hlstate *rec = NULL;
+    static int reccap = 0;
+    int nrec = 0;
+    int next_cp = i + KILO_HL_CHECKPOINT;
+    int converged = 0;
+
+    while(i < row->rsize)
+    {
+        int prev_number = (i > 0 && hl[i - 1] == HL_NUMBER);
+
+        if(i >= at + ins)
+        {
+            while(k < ncp && cp[k].pos + delta < i)
+                k++;
+
+            if(k < ncp && cp[k].pos + delta == i && cp[k].prev_sep == prev_sep &&
+               cp[k].prev_number == prev_number &&
+               cp[k].in_string == in_string && cp[k].in_comment == in_comment)
+            {
+                converged = 1;
+                break;
+            }
+        }
+
+        if(i >= next_cp)
+        {
+            if(nrec == reccap)
+            {
+                reccap = reccap ? reccap * 2 : 16;
+                rec = realloc(rec, sizeof(struct hlstate) * reccap);
+            }
+
+            rec[nrec].pos = i;
+            rec[nrec].prev_sep = prev_sep;
+            rec[nrec].prev_number = prev_number;
+            rec[nrec].in_string = in_string;
+            rec[nrec].in_comment = in_comment;
+            nrec++;
+            next_cp = i + KILO_HL_CHECKPOINT;
+        }
+
+        char c = render[i];
+        unsigned char prev_hl = (i > 0) ? hl[i - 1] : HL_NORMAL;
+
+        // the span may still hold the old colors
+        hl[i] = HL_NORMAL;
+
+        if(scs_len && !in_string && !in_comment)
+        {
+            // check whether start as "//"
+            if(i + scs_len <= row->rsize && !memcmp(&render[i], scs, scs_len))
+            {
+                // set color for the rest of the line
+                memset(&hl[i], HL_COMMENT, row->rsize - i);
+                break;
+            }
+        }
+
+        if(mcs_len && mce_len && !in_string)
+        {
+            if(in_comment)
+            {
+                hl[i] = HL_MLCOMMENT;
+                if(i + mce_len <= row->rsize && !memcmp(&render[i], mce, mce_len))
+                {
+                    memset(&hl[i], HL_MLCOMMENT, mce_len);
+                    i += mce_len;
+                    in_comment = 0;
+                    prev_sep = 1;
+
+                    continue;
+                }
+                else
+                {
+                    i++;
+
+                    continue;
+                }
+            }
+            else if(i + mcs_len <= row->rsize && !memcmp(&render[i], mcs, mcs_len))
+            {
+                memset(&hl[i], HL_MLCOMMENT, mcs_len);
+                i += mcs_len;
+                in_comment = 1;
+
+                continue;
+            }
+        }
+
+        if(E.syntax->flags & HL_HIGHLIGHT_STRING)
+        {
+            if(in_string)
+            {
+                hl[i] = HL_STRING;
+
+                if(c == '\\' && i + 1 < row->rsize)
+                {
+                    hl[i + 1] = HL_STRING;
+                    i += 2;
+                    continue;
+                }
+
+                // whether the current character is the closing quote
+                if(c == in_string)
+                    in_string = 0;
+
+                i++;
+                /**
+                 * if we're done highlighting the string, the closing quote
+                 * is considered a separator
+                 */
+                prev_sep = 1;
+                continue;
+            }
+            else
+            {
+                // check is the beginning of one by checking for a double- or single-quote
+                if(c == '"' || c == '\'')
+                {
+                    in_string = c;
+                    hl[i] = HL_STRING;
+                    i++;
+                    continue;
+                }
+            }
+        }
+
+        if(E.syntax->flags & HL_HIGHLIGHT_NUMBERS)
+        {
+            // support decimal points
+            if(((E.hlm.cclass[(unsigned char)c] & CC_DIGIT) &&
+                (prev_sep || prev_hl == HL_NUMBER)) ||
+               (c == '.' && prev_hl == HL_NUMBER))
+            {
+                hl[i] = HL_NUMBER;
+                i++;
+                prev_sep = 0;
+
+                continue;
+            }
+        }
+
+        if(prev_sep && (E.hlm.cclass[(unsigned char)c] & CC_KEYWORD))
+        {
+            int klen;
+            int kw = editorSyntaxKeyword(&render[i], row->rsize - i, &klen);
+
+            if(kw)
+            {
+                memset(&hl[i], kw, klen);
+                i += klen;
+                prev_sep = 0;
+
+                continue;
+            }
+        }
+
+        prev_sep = is_separator(c);
+        i++;
+    }
+
+    /**
+     * keep the checkpoints before the span, the new ones of the span and,
+     * when the highlighting stopped early, the old ones behind it moved by
+     * delta
+     */
+    int tail = converged ? ncp - k : 0;
+    int n = r + 1 + nrec + tail;
+
+    if(n > ncp)
+        row->hl_cp = cp = realloc(cp, sizeof(struct hlstate) * n);
+
+    if(tail)
+        memmove(&cp[r + 1 + nrec], &cp[k], sizeof(struct hlstate) * tail);
+    if(nrec)
+        memcpy(&cp[r + 1], rec, sizeof(struct hlstate) * nrec);
+    for(j = r + 1 + nrec; j < n; j++)
+        cp[j].pos += delta;
+    row->hl_ncp = n;
+
+    editorHlSplice(row, hl, from, converged ? i : row->rsize);
+
+    // the end of the row is the same as before when it stopped early
+    if(converged)
+        in_comment = row->hl_open_comment;
+
+    editorSyntaxSetState(filerow, row, in_comment);
+}
+
+// highlight the whole row, or only follow its state when it isn't rendered yet
+void editorSyntaxRow(int filerow, erow *row, int in_comment)
+{
+    if(!(row->rflags & ROW_RENDERED))
+    {
+        editorSyntaxUpdateState(filerow, row, in_comment);
+        return;
+    }
+
+    if(E.syntax == NULL)
+    {
+        slabFree(row->hl);
+        row->hl = NULL;
+        row->hl_n = 0;
+        row->hl_in_comment = in_comment;
+        editorSyntaxSetState(filerow, row, 0);
+        return;
+    }
+
+    // the whole row is highlighted again, so are its checkpoints
+    row->hl_ncp = 0;
+    editorHighlight(filerow, row, in_comment, 0, 0, row->rsize);
+}
+
+/**
+ * make the comment state of every row above "at" up to date. This is a loop
+ * over the rows behind hl_valid_rows instead of a recursion into the next
+ * row, and a row whose state from above didn't change since it was
+ * highlighted is kept as it is.
+ */
+void editorSyntaxSync(int at)
+{
+    int filerow = E.hl_valid_rows;
+
+    if(filerow >= at)
+        return;
+
+    int pos;
+    struct rownode *leaf = rowTreeFind(filerow, &pos);
+    int in_comment = (filerow > 0 && editorRowAt(filerow - 1)->hl_open_comment);
+
+    while(filerow < at)
+    {
+        // a leaf without rows is followed as a whole, it keeps the state of its lines
+        if(pos == 0 && leaf->u.rows == NULL && filerow + leaf->n <= at)
+        {
+            if(leaf->hl_in_comment != in_comment)
+            {
+                erow tmp;
+
+                leaf->hl_in_comment = in_comment;
+
+                for(int i = 0; i < leaf->n; i++)
+                {
+                    rowLineInit(leaf, i, &tmp);
+                    in_comment = editorSyntaxFollow(&tmp, in_comment);
+                }
+
+                leaf->hl_open_comment = in_comment;
+            }
+
+            in_comment = leaf->hl_open_comment;
+            filerow += leaf->n;
+            E.hl_valid_rows = filerow;
+            leaf = leaf->next;
+
+            continue;
+        }
+
+        erow *row = &rowLeafRows(leaf)[pos];
+
+        if(row->hl_in_comment != in_comment)
+            editorSyntaxRow(filerow, row, in_comment);
+        else
+            E.hl_valid_rows = filerow + 1;
+
+        in_comment = row->hl_open_comment;
+        filerow++;
+
+        if(++pos == leaf->n)
+        {
+            leaf = leaf->next;
+            pos = 0;
+        }
+    }
+}
+
+void editorUpdateSyntax(int filerow)
+{
+    // the state of the rows above must be known before highlighting this one
+    editorSyntaxSync(filerow);
+
+    int in_comment = (filerow > 0 && editorRowAt(filerow - 1)->hl_open_comment);
+
+    editorSyntaxRow(filerow, editorRowAt(filerow), in_comment);
+}
+
+// highlight a row after the "del" columns at "at" were replaced by "ins" new ones
+void editorUpdateSyntaxSpan(int filerow, int at, int del, int ins)
+{
+    editorSyntaxSync(filerow);
+
+    erow *row = editorRowAt(filerow);
+    int in_comment = (filerow > 0 && editorRowAt(filerow - 1)->hl_open_comment);
+
+    // a row without syntax has no spans, it stays HL_NORMAL
+    if(E.syntax == NULL)
+        return;
+
+    // the checkpoints are only good when the state from above is still the same
+    if(row->hl_in_comment != in_comment)
+    {
+        editorSyntaxRow(filerow, row, in_comment);
+        return;
+    }
+
+    editorHighlight(filerow, row, in_comment, at, del, ins);
+}
+
+/**
+ * forget the highlighting of every row, they are highlighted again with the
+ * new syntax when they are drawn
+ */
+void editorSyntaxInvalidate()
+{
+    int pos;
+
+    E.hl_valid_rows = 0;
+
+    for(struct rownode *leaf = rowTreeFind(0, &pos); leaf; leaf = leaf->next)
+    {
+        leaf->hl_in_comment = -1;
+
+        for(pos = 0; leaf->u.rows && pos < leaf->n; pos++)
+            leaf->u.rows[pos].hl_in_comment = -1;
+    }
+}
+
+void editorSelectSyntaxHighlight()
+{
+    E.syntax = NULL;
+
+    if(E.filename == NULL)
+        return;
+
+    // return a pointer to the last occurrence of character ('.')
+    // Example: hello.c, it will return .c
+    char *ext = strrchr(E.filename, '.');
+
+    for(unsigned int j = 0; j < HLDB_ENTRIES; j++)
+    {
+        struct editorSyntax *s = &HLDB[j];
+        unsigned int i = 0;
+
+        while(s->filematch[i])
+        {
+            int is_ext = (s->filematch[i][0] == '.');
+
+            if((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
+               (!is_ext && strstr(E.filename, s->filematch[i])))
+            {
+                E.syntax = s;
+                editorSyntaxCompile();
+                editorSyntaxInvalidate();
+
+                return;
+            }
+
+            i++;
+        }
+    }
+
+    editorSyntaxCompile();
+    editorSyntaxInvalidate();
+}
+
+/* row operations */
+
+/**
+ * The chars of a row are a gap buffer: the text is chars[0, gap) followed by
+ * chars[gap + gaplen, size + gaplen), the gap in between is free space.
+ * Typing moves the gap to the cursor once, after that inserting or deleting
+ * at the cursor only moves the edges of the gap instead of the rest of the
+ * line. A row without gap has it at the end with gaplen 0.
+ */
+#define ROW_CHAR(row, j) \
+    ((j) < (row)->gap ? (row)->chars[(j)] : (row)->chars[(j) + (row)->gaplen])
+
+/**
+ * the index of the first tab of a rendered row at or behind chars index cx,
+ * or behind render index rx, found by bisecting its tab index
+ */
+int editorRowTabAfter(int *tabs, int at, int field)
+{
+    int lo = 0, hi = tabs[0];
+
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        if (tabs[1 + 2 * mid + field] < at)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+// convert the chars index into a render index, the cursor would jump to the
+// beginning of next word if there is a '\t'
+int editorRowCxToRx(erow *row, int cx)
+{
+    int rx = 0;
+    int j;
+
+    // a rendered row knows where its tabs are, the rest of the chars are one column each
+    if (row->rflags & ROW_RENDERED)
+    {
+        if (row->tabs == NULL)
+            return cx;
+
+        j = editorRowTabAfter(row->tabs, cx, 0);
+
+        if (j == 0)
+            return cx;
+
+        int tcx = row->tabs[2 * j - 1];
+        int trx = row->tabs[2 * j];
+
+        return trx + KILO_TAB_STOP - trx % KILO_TAB_STOP + cx - tcx - 1;
+    }
+
+    for (j = 0; j < cx; j++)
+    {
+        if (ROW_CHAR(row, j) == '\t')
+        {
+            /**
+             * (rx % KILO_TAB_STOP) find out how many columns we are to the right of the last tab stop
+             * (KILO_TAB_STOP - 1) find out how many colunmns we are to the left of the next tab stop
+             */
+            rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+        }
+
+        // gets us right on the next tab stop
+        rx++;
+    }
+
+    return rx;
+}
+
+int editorRowRxToCx(erow *row, int rx)
+{
+    int cur_rx = 0;
+    int cx;
+
+    if (row->rflags & ROW_RENDERED)
+    {
+        // one more than the last tab that starts at or before rx
+        int k = row->tabs ? editorRowTabAfter(row->tabs, rx + 1, 1) : 0;
+
+        cx = rx;
+
+        if (k > 0)
+        {
+            int tcx = row->tabs[2 * k - 1];
+            int trx = row->tabs[2 * k];
+            int end = trx + KILO_TAB_STOP - trx % KILO_TAB_STOP;
+
+            cx = rx < end ? tcx : tcx + 1 + rx - end;
+        }
+
+        return cx < row->size ? cx : row->size;
+    }
+
+    for(cx = 0; cx < row->size; cx++)
+    {
+        if(ROW_CHAR(row, cx) == '\t')
+            cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
+
+        cur_rx++;
+
+        if(cur_rx > rx)
+            return cx;
+    }
+
+    return cx;
+}
+
+// copy a row which still points into the mapped file before editing it
+void editorRowDetach(erow *row)
+{
+    if(!(row->flags & ROW_MAPPED))
+        return;
+
+    char *chars = slabAlloc(row->size + 1);
+    memcpy(chars, row->chars, row->size);
+    chars[row->size] = '\0';
+
+    row->chars = chars;
+    row->flags &= ~ROW_MAPPED;
+}
+
+// move the gap so it starts at "at"
+void editorRowMoveGap(erow *row, int at)
+{
+    if (at < row->gap)
+        memmove(&row->chars[at + row->gaplen], &row->chars[at], row->gap - at);
+    else if (at > row->gap)
+        memmove(&row->chars[row->gap], &row->chars[row->gap + row->gaplen], at - row->gap);
+
+    row->gap = at;
+}
+
+// make room for "len" more chars in the gap, the buffer grows geometrically
+void editorRowGrowGap(erow *row, int len)
+{
+    if (row->gaplen >= len)
+        return;
+
+    int gaplen = (row->size > len) ? row->size : len;
+
+    if (gaplen < 16)
+        gaplen = 16;
+
+    row->chars = slabRealloc(row->chars, row->size + gaplen + 1);
+    // move the text behind the gap to the end of the bigger buffer
+    memmove(&row->chars[row->gap + gaplen], &row->chars[row->gap + row->gaplen],
+            row->size - row->gap);
+    row->gaplen = gaplen;
+}
+
+/**
+ * the text of the row in one piece, the gap is moved to the end. The search
+ * threads read the rows while a search runs, so then a row with its gap
+ * inside is copied out instead, the copy is good until the next call
+ */
+char *editorRowText(erow *row)
+{
+    static char *copy = NULL;
+    static int copycap = 0;
+
+    if (E.search.running && row->gap < row->size)
+    {
+        if (row->size + 1 > copycap)
+        {
+            copycap = row->size + 1;
+            copy = realloc(copy, copycap);
+        }
+
+        memcpy(copy, row->chars, row->gap);
+        memcpy(&copy[row->gap], &row->chars[row->gap + row->gaplen], row->size - row->gap);
+        copy[row->size] = '\0';
+
+        return copy;
+    }
+
+    editorRowMoveGap(row, row->size);
+
+    if (!(row->flags & ROW_MAPPED))
+        row->chars[row->size] = '\0';
+
+    return row->chars;
+}
+
+// the text as it is drawn, a row without tabs is drawn straight from its chars
+char *editorRowRender(erow *row)
+{
+    return (row->rflags & ROW_TABS) ? row->render : editorRowText(row);
+}
+
+// the text of the row changed, so have the search look at it again
+void editorRowForgetMatches(erow *row)
+{
+    free(row->matches);
+    row->matches = NULL;
+}
+
+void editorUpdateRow(int filerow)
+{
+    erow *row = editorRowAt(filerow);
+    char *chars = editorRowText(row);
+    int tabs = 0;
+    int j;
+
+    editorRowForgetMatches(row);
+
+    for (j = 0; j < row->size; j++)
+        if (chars[j] == '\t')
+            tabs++;
+
+    if (tabs)
+        row->rflags |= ROW_TABS;
+    else
+        row->rflags &= ~ROW_TABS;
+
+    row->rflags |= ROW_RENDERED;
+    slabFree(row->render);
+    free(row->tabs);
+    row->render = NULL;
+    row->tabs = NULL;
+    row->rsize = row->size;
+
+    if (tabs)
+    {
+        row->rsize = row->size + tabs * (KILO_TAB_STOP - 1);
+        row->render = slabAlloc(row->rsize + 1);
+        row->tabs = malloc((1 + 2 * tabs) * sizeof(int));
+        row->tabs[0] = 0;
+
+        int idx = 0;
+        for (j = 0; j < row->size; j++)
+        {
+            if (chars[j] == '\t')
+            {
+                int *t = &row->tabs[1 + 2 * row->tabs[0]++];
+
+                t[0] = j;
+                t[1] = idx;
+                row->render[idx++] = ' ';
+
+                while (idx % KILO_TAB_STOP != 0)
+                    row->render[idx++] = ' ';
+            }
+            else
+            {
+                row->render[idx++] = chars[j];
+            }
+        }
+
+        row->render[idx] = '\0';
+        row->rsize = idx;
+    }
+
+    editorUpdateSyntax(filerow);
+}
+
+/**
+ * render a row with tabs again after "delta" chars were inserted at "at",
+ * or removed when delta is negative. Only the columns from the edit to the
+ * end of the next tab are rendered: a tab ends on a tab stop, so the
+ * columns behind it keep their text and only move, by whole tab stops or
+ * not at all. Without a tab behind the edit the rest of the row is moved
+ * as it is. The old columns [*rat, *rat + *rdel) are now [*rat, *rat + *rins).
+ * Returns 0 if the row has no tab left.
+ */
+int editorRowRenderSpan(erow *row, int at, int delta, int *rat, int *rdel, int *rins)
+{
+    int *tabs = row->tabs;
+    int n = tabs[0];
+    int ins = (delta > 0) ? delta : 0;
+    int del = (delta < 0) ? -delta : 0;
+    int first = editorRowTabAfter(tabs, at, 0); // the first tab the edit may have removed
+    int k = editorRowTabAfter(tabs, at + del, 0); // the first one behind the edit
+    int rx = editorRowCxToRx(row, at);
+    int oldend, cend, end, added = 0;
+    char *chars = editorRowText(row);
+    int j, t;
+
+    if (k < n)
+    {
+        oldend = tabs[2 + 2 * k] + KILO_TAB_STOP - tabs[2 + 2 * k] % KILO_TAB_STOP;
+        cend = tabs[1 + 2 * k] + delta + 1;
+    }
+    else
+    {
+        oldend = row->rsize - (row->size - at - ins);
+        cend = at + ins;
+    }
+
+    end = rx;
+    for (j = at; j < cend; j++)
+    {
+        if (chars[j] == '\t')
+        {
+            end += KILO_TAB_STOP - end % KILO_TAB_STOP;
+            added++;
+        }
+        else
+        {
+            end++;
+        }
+    }
+
+    int removed = k - first + (k < n);
+    int ntabs = n - removed + added;
+    int shift = end - oldend;
+
+    if (ntabs == 0)
+        return 0;
+
+    if (shift > 0)
+        row->render = slabRealloc(row->render, row->rsize + shift + 1);
+    if (shift)
+        memmove(&row->render[end], &row->render[oldend], row->rsize - oldend);
+    row->rsize += shift;
+    row->render[row->rsize] = '\0';
+
+    // the tabs behind the span keep their place in the index, only moved
+    if (ntabs > n)
+        row->tabs = tabs = realloc(tabs, (1 + 2 * ntabs) * sizeof(int));
+    memmove(&tabs[1 + 2 * (first + added)], &tabs[1 + 2 * (first + removed)],
+            (n - first - removed) * 2 * sizeof(int));
+    for (j = first + added; j < ntabs; j++)
+    {
+        tabs[1 + 2 * j] += delta;
+        tabs[2 + 2 * j] += shift;
+    }
+    tabs[0] = ntabs;
+
+    for (j = at, t = first, end = rx; j < cend; j++)
+    {
+        if (chars[j] == '\t')
+        {
+            tabs[1 + 2 * t] = j;
+            tabs[2 + 2 * t++] = end;
+            row->render[end++] = ' ';
+
+            while (end % KILO_TAB_STOP != 0)
+                row->render[end++] = ' ';
+        }
+        else
+        {
+            row->render[end++] = chars[j];
+        }
+    }
+
+    *rat = rx;
+    *rdel = oldend - rx;
+    *rins = end - rx;
+
+    return 1;
+}
+
+/**
+ * update render and hl after "delta" chars were inserted at "at", or
+ * removed when delta is negative. A row without tabs is drawn from chars,
+ * so only the hl spans behind the edit are moved and the span around it is
+ * highlighted again. A row with tabs gets the same after its render was
+ * patched from the edit to the next tab. The first tab of a row builds it
+ * all, so does removing the last one. Either way the gap ends up at the end
+ * of the row, so drawing never moves it.
+ */
+void editorUpdateRowSpan(int filerow, int at, int delta)
+{
+    erow *row = editorRowAt(filerow);
+    int rat = at, rdel = (delta < 0) ? -delta : 0, rins = (delta > 0) ? delta : 0;
+    int j;
+
+    editorRowForgetMatches(row);
+
+    if (!(row->rflags & ROW_RENDERED))
+    {
+        editorUpdateRow(filerow);
+        return;
+    }
+
+    if (row->rflags & ROW_TABS)
+    {
+        if (!editorRowRenderSpan(row, at, delta, &rat, &rdel, &rins))
+        {
+            editorUpdateRow(filerow);
+            return;
+        }
+    }
+    else
+    {
+        for (j = 0; j < delta; j++)
+        {
+            if (ROW_CHAR(row, at + j) == '\t')
+            {
+                editorUpdateRow(filerow);
+                return;
+            }
+        }
+
+        editorRowText(row);
+        row->rsize += delta;
+    }
+
+    editorHlShift(row, rat, rdel, rins);
+    editorUpdateSyntaxSpan(filerow, rat, rdel, rins);
+}
+
+/**
+ * build render and hl of a row loaded from the mapped file the first time it
+ * is needed, or highlight it again when a change above made it stale
+ */
+void editorPrepareRow(int at)
+{
+    if (!(editorRowAt(at)->rflags & ROW_RENDERED))
+        editorUpdateRow(at);
+    else
+        editorSyntaxSync(at + 1);
+}
+
+// a row of len chars that has no render and was never highlighted
+void editorRowInit(erow *row, char *chars, int len, int flags)
+{
+    row->size = len;
+    row->gap = len;
+    row->gaplen = 0;
+    row->chars = chars;
+
+    row->rsize = 0;
+    row->render = NULL;
+    row->tabs = NULL;
+    row->hl = NULL;
+    row->hl_n = 0;
+    row->hl_cp = NULL;
+    row->hl_ncp = 0;
+    row->hl_in_comment = -1;
+    row->hl_open_comment = 0;
+    row->flags = flags;
+    row->rflags = 0;
+    row->matches = NULL;
+}
+
+// a copy of s with '\0' behind it, from the slabs
+char *editorRowCopy(char *s, size_t len)
+{
+    char *chars = slabAlloc(len + 1);
+
+    memcpy(chars, s, len);
+    chars[len] = '\0';
+
+    return chars;
+}
+
+void editorInsertRow(int at, char *s, size_t len)
+{
+    if (at < 0 || at > E.numrows)
+        return;
+
+    erow *row = rowTreeInsert(at);
+
+    editorRowInit(row, editorRowCopy(s, len), len, 0);
+
+    // the row below has a new row above it, check it again when it's needed
+    if(at < E.hl_valid_rows)
+        E.hl_valid_rows = at;
+
+    // s may be the rest of a row above, which moves its gap when it is highlighted again
+    journalRecord(J_INSERT_ROW, at, 0, s, len);
+    undoRecord(U_INSERT_ROW, at, 0, s, len, NULL, 0);
+
+    editorUpdateRow(at);
+    E.dirty++;
+}
+
+/**
+ * insert a row for every line of s at "at", the lines end with \n, \r or
+ * \r\n, and the text behind the last line ending is a row too. The rows are
+ * rendered and highlighted when they are drawn, like the ones of a mapped
+ * file. Returns the number of rows inserted
+ */
+int editorInsertRows(int at, char *s, size_t len)
+{
+    char *p = s;
+    char *end = s + len;
+    int n = 0;
+
+    if (at < 0 || at > E.numrows)
+        return 0;
+
+    while (1)
+    {
+        char *q = p;
+
+        while (q < end && *q != '\n' && *q != '\r')
+            q++;
+
+        erow *row = rowTreeInsert(at + n);
+        editorRowInit(row, editorRowCopy(p, q - p), q - p, 0);
+        n++;
+
+        if (q == end)
+            break;
+
+        p = q + ((*q == '\r' && q + 1 < end && q[1] == '\n') ? 2 : 1);
+    }
+
+    if(at < E.hl_valid_rows)
+        E.hl_valid_rows = at;
+
+    journalRecord(J_INSERT_ROWS, at, 0, s, len);
+    undoRecord(U_INSERT_ROWS, at, n, s, len, NULL, 0);
+    E.dirty++;
+
+    return n;
+}
+
+void editorFreeRow(erow *row)
+{
+    slabFree(row->render);
+    slabFree(row->hl);
+    free(row->tabs);
+    free(row->hl_cp);
+    free(row->matches);
+
+    if(!(row->flags & ROW_MAPPED))
+        slabFree(row->chars);
+}
+
+void editorDelRow(int at)
+{
+    if (at < 0 || at >= E.numrows)
+        return;
+
+    erow *row = editorRowAt(at);
+
+    undoRecord(U_DEL_ROW, at, 0, editorRowText(row), row->size, NULL, 0);
+    editorFreeRow(row);
+    // the rows behind it are only shifted inside one leaf of the tree
+    rowTreeDelete(at);
+
+    // so does the row which moves up into its place
+    if(at < E.hl_valid_rows)
+        E.hl_valid_rows = at;
+
+    journalRecord(J_DEL_ROW, at, 0, NULL, 0);
+    E.dirty++;
+}
+
+void editorRowInsertChar(int filerow, int at, int c)
+{
+    erow *row = editorRowAt(filerow);
+    char ch = c;
+
+    if (at < 0 || at > row->size)
+        at = row->size;
+
+    editorRowDetach(row);
+    editorRowMoveGap(row, at);
+    editorRowGrowGap(row, 1);
+
+    row->chars[row->gap++] = c;
+    row->gaplen--;
+    row->size++;
+
+    editorUpdateRowSpan(filerow, at, 1);
+    journalRecord(J_INSERT, filerow, at, &ch, 1);
+    undoRecord(U_INSERT, filerow, at, &ch, 1, NULL, 0);
+    E.dirty++;
+}
+
+// insert len chars of s at "at"
+void editorRowInsertString(int filerow, int at, char *s, size_t len)
+{
+    erow *row = editorRowAt(filerow);
+
+    if (len == 0)
+        return;
+
+    if (at < 0 || at > row->size)
+        at = row->size;
+
+    editorRowDetach(row);
+    editorRowMoveGap(row, at);
+    editorRowGrowGap(row, len);
+
+    memcpy(&row->chars[row->gap], s, len);
+    row->gap += len;
+    row->gaplen -= len;
+    row->size += len;
+
+    editorUpdateRowSpan(filerow, at, len);
+    journalRecord(J_INSERT, filerow, at, s, len);
+    undoRecord(U_INSERT, filerow, at, s, len, NULL, 0);
+    E.dirty++;
+}
+
+// remove len chars at "at"
+void editorRowDelString(int filerow, int at, int len)
+{
+    erow *row = editorRowAt(filerow);
+
+    if (at < 0 || len <= 0 || at + len > row->size)
+        return;
+
+    editorRowDetach(row);
+    editorRowMoveGap(row, at);
+
+    // the text stays where it is, it just becomes part of the gap
+    char *text = &row->chars[at + row->gaplen];
+
+    undoRecord(U_DELETE, filerow, at, text, len, NULL, 0);
+
+    row->gaplen += len;
+    row->size -= len;
+
+    editorUpdateRowSpan(filerow, at, -len);
+    // the text isn't needed to delete it again, and it may have moved by now
+    journalRecord(J_DELETE, filerow, at, NULL, len);
+    E.dirty++;
+}
+
+// cut the row off at "at"
+void editorRowTruncate(int filerow, int at)
+{
+    erow *row = editorRowAt(filerow);
+    int len = row->size - at;
+
+    if (at < 0 || len <= 0)
+        return;
+
+    editorRowDetach(row);
+    editorRowMoveGap(row, at);
+    undoRecord(U_TRUNCATE, filerow, at, &row->chars[at + row->gaplen], len, NULL, 0);
+
+    row->size = at;
+    row->gaplen += len;
+
+    editorUpdateRowSpan(filerow, at, -len);
+    journalRecord(J_TRUNCATE, filerow, at, NULL, 0);
+    E.dirty++;
+}
+
+/**
+ * give the row new text, chars is from slabAlloc() with room for cap chars
+ * and is taken over by the row
+ */
+void editorRowSetText(int filerow, char *chars, int size, int cap)
+{
+    erow *row = editorRowAt(filerow);
+
+    undoRecord(U_SET_ROW, filerow, 0, editorRowText(row), row->size, chars, size);
+
+    if (!(row->flags & ROW_MAPPED))
+        slabFree(row->chars);
+
+    row->chars = chars;
+    row->size = size;
+    row->gap = size;
+    row->gaplen = cap - size;
+    row->flags &= ~ROW_MAPPED;
+    row->chars[size] = '\0';
+
+    editorUpdateRow(filerow);
+    journalRecord(J_SET_ROW, filerow, 0, chars, size);
+    E.dirty++;
+}
+
+void editorRowAppenedString(int filerow, char *s, size_t len)
+{
+    erow *row = editorRowAt(filerow);
+    int at = row->size;
+
+    editorRowDetach(row);
+    editorRowMoveGap(row, row->size);
+    // including '\0'
+    editorRowGrowGap(row, len + 1);
+
+    memcpy(&row->chars[row->size], s, len);
+    row->size += len;
+    row->gap += len;
+    row->gaplen -= len;
+    row->chars[row->size] = '\0';
+    editorUpdateRow(filerow);
+    journalRecord(J_INSERT, filerow, at, s, len);
+    undoRecord(U_INSERT, filerow, at, s, len, NULL, 0);
+    E.dirty++;
+}
+
+void editorRowDelChar(int filerow, int at)
+{
+    erow *row = editorRowAt(filerow);
+
+    if (at < 0 || at >= row->size)
+        return;
+
+    editorRowDetach(row);
+    // the char to delete ends up right before the gap
+    editorRowMoveGap(row, at + 1);
+    undoRecord(U_DELETE, filerow, at, &row->chars[at], 1, NULL, 0);
+
+    row->gap--;
+    row->gaplen++;
+    row->size--;
+
+    editorUpdateRowSpan(filerow, at, -1);
+    journalRecord(J_DEL_CHAR, filerow, at, NULL, 0);
+    E.dirty++;
+}
+
+/* editor operations */
+
+void editorInsertChar(int c)
+{
+    // whether the cursor is on the tilde line after the end of the file
+    if (E.cy == E.numrows)
+    {
+        // append a new row to the file before insertinga character there
+        editorInsertRow(E.numrows, "", 0);
+    }
+
+    editorRowInsertChar(E.cy, E.cx, c);
+    E.cx++;
+}
+
+void editorInsertNewline()
+{
+    if (E.cx == 0)
+    {
+        editorInsertRow(E.cy, "", 0);
+    }
+    else
+    {
+        erow *row = editorRowAt(E.cy);
+
+        // with the gap at the cursor the rest of the line is in one piece
+        editorRowDetach(row);
+        editorRowMoveGap(row, E.cx);
+
+        int len = row->size - E.cx;
+        editorInsertRow(E.cy + 1, &row->chars[E.cx + row->gaplen], len);
+        editorRowTruncate(E.cy, E.cx);
+    }
+
+    E.cy++;
+    E.cx = 0;
+}
+
+/**
+ * insert text at the cursor as if it were typed, but with every line of it
+ * added in one go, so only the rows at both ends are built again
+ */
+void editorInsertText(char *s, size_t len)
+{
+    // at the end of the file a newline only adds an empty row, as Enter does
+    while (len && E.cy == E.numrows && (s[0] == '\n' || s[0] == '\r'))
+    {
+        size_t nl = (s[0] == '\r' && len > 1 && s[1] == '\n') ? 2 : 1;
+
+        editorInsertNewline();
+        s += nl;
+        len -= nl;
+    }
+
+    if (len == 0)
+        return;
+
+    if (E.cy == E.numrows)
+        editorInsertRow(E.numrows, "", 0);
+
+    size_t first = 0;
+    while (first < len && s[first] != '\n' && s[first] != '\r')
+        first++;
+
+    erow *row = editorRowAt(E.cy);
+
+    editorRowDetach(row);
+    editorRowMoveGap(row, E.cx);
+
+    // the rest of the line goes behind the last line of the text
+    int taillen = first < len ? row->size - E.cx : 0;
+    char *tail = editorRowCopy(&row->chars[E.cx + row->gaplen], taillen);
+
+    if (taillen)
+        editorRowTruncate(E.cy, E.cx);
+    editorRowInsertString(E.cy, E.cx, s, first);
+
+    if (first == len)
+    {
+        E.cx += first;
+        slabFree(tail);
+        return;
+    }
+
+    first += (s[first] == '\r' && first + 1 < len && s[first + 1] == '\n') ? 2 : 1;
+    E.cy += editorInsertRows(E.cy + 1, &s[first], len - first);
+    E.cx = editorRowAt(E.cy)->size;
+
+    editorRowAppenedString(E.cy, tail, taillen);
+    slabFree(tail);
+}
+
+void editorDelChar()
+{
+    if (E.cy == E.numrows)
+        return;
+
+    if (E.cx == 0 && E.cy == 0)
+        return;
+
+    erow *row = editorRowAt(E.cy);
+
+    if (E.cx > 0)
+    {
+        editorRowDelChar(E.cy, E.cx - 1);
+        E.cx--;
+    }
+    // if the cursor is in the beginning of the line
+    else
+    {
+        E.cx = editorRowAt(E.cy - 1)->size;
+        editorRowAppenedString(E.cy - 1, editorRowText(row), row->size);
+        editorDelRow(E.cy);
+        E.cy--;
+    }
+}
+
+/* file i/o */
+
+// write all of iov, going on after short writes
+int editorWritev(int fd, struct iovec *iov, int cnt)
+{
+    while (cnt > 0)
+    {
+        ssize_t n = writev(fd, iov, cnt);
+
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        while (cnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+
+        if (cnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * write every row to fd straight from where its text is, both halves of the
+ * gap and a newline, KILO_SAVE_IOV pieces at a time. Pieces that follow
+ * each other in memory are joined, so the untouched part of a mapped file
+ * goes out in a few big pieces. Returns the bytes written, or -1.
+ */
+long long editorWriteRows(int fd)
+{
+    static char newline = '\n';
+    struct iovec iov[KILO_SAVE_IOV];
+    long long total = 0;
+    int cnt = 0;
+    int j;
+
+    for (struct rownode *leaf = rowTreeFind(0, &j); leaf; leaf = leaf->next)
+    {
+        for (j = 0; j < leaf->n; j++)
+        {
+            erow tmp;
+            erow *row = rowLeafPeek(leaf, j, &tmp);
+            char *nl = &newline;
+
+            // a mapped row is usually followed by its own newline
+            if ((row->flags & ROW_MAPPED) && row->chars + row->size < E.map + E.mapsize &&
+                row->chars[row->size] == '\n')
+                nl = row->chars + row->size;
+
+            struct iovec piece[3] = {
+                {row->chars, row->gap},
+                {row->chars + row->gap + row->gaplen, row->size - row->gap},
+                {nl, 1},
+            };
+
+            for (int k = 0; k < 3; k++)
+            {
+                if (piece[k].iov_len == 0)
+                    continue;
+
+                total += piece[k].iov_len;
+
+                if (cnt && (char *)iov[cnt - 1].iov_base + iov[cnt - 1].iov_len == piece[k].iov_base)
+                {
+                    iov[cnt - 1].iov_len += piece[k].iov_len;
+                    continue;
+                }
+
+                if (cnt == KILO_SAVE_IOV)
+                {
+                    if (editorWritev(fd, iov, cnt) == -1)
+                        return -1;
+                    cnt = 0;
+                }
+
+                iov[cnt++] = piece[k];
+            }
+        }
+    }
+
+    if (cnt && editorWritev(fd, iov, cnt) == -1)
+        return -1;
+
+    return total;
+}
+
+/**
+ * index the lines of a mapped file, nothing is copied. The tree is built
+ * bottom up from leaves that only hold where their lines start, the rows are
+ * made when a leaf is reached, and render and hl when the row is drawn.
+ */
+void editorLoadMapped(char *map, size_t mapsize)
+{
+    E.map = map;
+    E.mapsize = mapsize;
+
+    char *p = map;
+    char *end = map + mapsize;
+    struct rownode **level = NULL, *prev = NULL;
+    int n = 0, cap = 0;
+
+    while (p < end)
+    {
+        struct rownode *leaf = rowNodeMapped(p);
+
+        while (leaf->n < ROWTREE_FANOUT && p < end)
+        {
+            char *nl = memchr(p, '\n', end - p);
+            char *next = nl ? nl + 1 : end;
+
+            // the offsets are ints, a leaf stops before it spans more
+            if (leaf->n > 0 && next - leaf->base > INT_MAX)
+                break;
+
+            p = next;
+            leaf->lines[++leaf->n] = p - leaf->base;
+        }
+
+        leaf->prev = prev;
+        if (prev)
+            prev->next = leaf;
+        prev = leaf;
+
+        if (n == cap)
+        {
+            cap = cap ? cap * 2 : 64;
+            if ((level = realloc(level, sizeof(struct rownode *) * cap)) == NULL)
+                die("realloc");
+        }
+
+        level[n++] = leaf;
+        E.numrows += leaf->n;
+    }
+
+    // every level shares its nodes evenly between the parents above it
+    while (n > 1)
+    {
+        int parents = (n + ROWTREE_FANOUT - 1) / ROWTREE_FANOUT;
+        int k = 0;
+
+        for (int i = 0; i < parents; i++)
+        {
+            struct rownode *node = rowNodeNew(0);
+            int stop = (int)((long long)n * (i + 1) / parents);
+
+            for (; k < stop; k++)
+            {
+                node->u.in.child[node->n] = level[k];
+                node->u.in.count[node->n++] = rowNodeCount(level[k]);
+            }
+
+            level[i] = node;
+        }
+
+        n = parents;
+    }
+
+    if (n)
+    {
+        rowNodeFree(E.rows);
+        E.rows = level[0];
+    }
+
+    free(level);
+}
+
+void editorOpen(char *filename)
+{
+    free(E.filename);
+    // makes a copy of the given string, allocating the required memory
+    // and assuming you will free that memory.
+    E.filename = strdup(filename);
+
+    editorSelectSyntaxHighlight();
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        die("open");
+
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        die("fstat");
+
+    /**
+     * map regular files instead of reading them, so opening a huge file
+     * doesn't copy it into memory. Empty files can't be mapped, and pipes or
+     * devices fall back to reading line by line.
+     */
+    if (S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (map != MAP_FAILED)
+        {
+            editorLoadMapped(map, st.st_size);
+            close(fd);
+            E.dirty = 0;
+
+            return;
+        }
+    }
+
+    FILE *fp = fdopen(fd, "r");
+    if (!fp)
+        die("fdopen");
+
+    char *line = NULL;
+    size_t linecap = 0; // line capacity
+    ssize_t linelen;
+
+    E.undo.paused = 1;
+
+    // get a line of text from the file and get the length of line it read
+    // whether is the EOF
+    while ((linelen = getline(&line, &linecap, fp)) != -1)
+    {
+        // truncate the \r\n
+        while (linelen > 0 && (line[linelen - 1] == '\n' ||
+                               line[linelen - 1] == '\r'))
+            linelen--;
+
+        editorInsertRow(E.numrows, line, linelen);
+    }
+
+    E.undo.paused = 0;
+
+    free(line);
+    fclose(fp);
+    E.dirty = 0;
+}
+
+/**
+ * the rows are written to a new file "tmp" next to the real one, which is
+ * synced and then renamed over it, so the file on disk is always either the
+ * old one or the new one. The old file stays mapped until exit, the rows that
+ * still point into it don't notice the rename. Returns the bytes written, or
+ * -1 with the error in *err.
+ */
+long long editorSaveFile(char *target, char *tmp, int *err)
+{
+    long long len = -1;
+    struct stat st;
+    int fd = mkstemp(tmp);
+
+    *err = 0;
+
+    if (fd == -1)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    // keep the permissions of the file being replaced
+    fchmod(fd, stat(target, &st) == 0 ? st.st_mode & 07777 : 0644);
+
+    len = editorWriteRows(fd);
+
+    if (len != -1 && fsync(fd) == -1)
+        len = -1;
+    if (close(fd) == -1)
+        len = -1;
+    if (len != -1 && rename(tmp, target) == -1)
+        len = -1;
+    if (len == -1)
+    {
+        *err = errno;
+        unlink(tmp);
+        return -1;
+    }
+
+    // make the rename itself durable by syncing the directory
+    char *slash;
+    int dir;
+
+    strcpy(tmp, target);
+    slash = strrchr(tmp, '/');
+    if (slash == NULL)
+        strcpy(tmp, ".");
+    else
+        slash[slash == tmp] = '\0';
+
+    if ((dir = open(tmp, O_RDONLY)) != -1)
+    {
+        fsync(dir);
+        close(dir);
+    }
+
+    return len;
+}
+
+// only the edits made after the snapshot are left unsaved
+void editorSaveReport(struct saveresult *res)
+{
+    if (res->len != -1)
+    {
+        E.dirty -= E.save.dirty;
+        journalRebase(E.save.jpos);
+        editorSetStatusMessage("%lld bytes written to disk", res->len);
+        return;
+    }
+
+    // strerror returns human readable string for the error code
+    editorSetStatusMessage("Can't save! I/O error: %s", strerror(res->err));
+}
+
+// the save process finished, or died
+void editorSaveDone()
+{
+    struct saveresult res;
+
+    if (read(E.save.fd, &res, sizeof(res)) != sizeof(res))
+    {
+        res.len = -1;
+        res.err = EIO;
+    }
+
+    close(E.save.fd);
+    waitpid(E.save.pid, NULL, 0);
+    E.save.fd = -1;
+    E.save.pid = 0;
+    editorSaveReport(&res);
+}
+
+// block until the running save is done
+void editorSaveWait()
+{
+    struct pollfd fd = {E.save.fd, POLLIN, 0};
+
+    if (E.save.pid == 0)
+        return;
+
+    while (poll(&fd, 1, -1) == -1 && errno == EINTR)
+        ;
+
+    editorSaveDone();
+}
+
+void editorSave()
+{
+    /**
+     * Bash on Windows required to press ESC 3 times to get one ESC keypress
+     * to register in out program, because the read() calls in editorReadKey()
+     * that look for an escape sequemce never time out.
+     */
+
+    if (E.filename == NULL)
+    {
+        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL, 0);
+
+        if (E.filename == NULL)
+        {
+            editorSetStatusMessage("Save aborted");
+            return;
+        }
+
+        editorSelectSyntaxHighlight();
+    }
+
+    // one save at a time, so they reach the disk in order
+    editorSaveWait();
+
+    /**
+     * the file is written by a child process, fork() makes it a copy on
+     * write snapshot of the rows for free and editing goes on meanwhile.
+     * The child doesn't allocate, the names are made up front.
+     */
+    char *path = realpath(E.filename, NULL);
+    char *target = path ? path : E.filename;
+    char *tmp = malloc(strlen(target) + 8);
+    struct saveresult res;
+    int fds[2];
+
+    sprintf(tmp, "%s.XXXXXX", target);
+
+    /**
+     * the records behind this point are edits the snapshot doesn't have,
+     * with no journal yet they start right after the header it will get
+     */
+    journalFlush();
+    E.save.jpos = E.journal.fd == -1 ? (long long)sizeof(struct jhead) : E.journal.pos;
+
+    if (pipe(fds) != -1)
+    {
+        pid_t pid = fork();
+
+        if (pid == 0)
+        {
+            close(fds[0]);
+            res.len = editorSaveFile(target, tmp, &res.err);
+            write(fds[1], &res, sizeof(res));
+            _exit(0);
+        }
+
+        close(fds[1]);
+
+        if (pid != -1)
+        {
+            E.save.pid = pid;
+            E.save.fd = fds[0];
+            E.save.dirty = E.dirty;
+            free(tmp);
+            free(path);
+            editorSetStatusMessage("Saving...");
+
+            return;
+        }
+
+        close(fds[0]);
+    }
+
+    // no process to spare, so the file is written right here
+    res.len = editorSaveFile(target, tmp, &res.err);
+    free(tmp);
+    free(path);
+    E.save.dirty = E.dirty;
+    editorSaveReport(&res);
+}
+
+/* journal */
+
+/**
+ * Every edit is also appended to a journal next to the file, .name.swp, so
+ * the edits made since the last save outlive a crash or a dropped ssh
+ * session. The records are collected in a buffer that is written once per
+ * batch of keys, and synced KILO_JOURNAL_SYNC seconds after an edit. The
+ * header names the exact file the records apply to, after a save the
+ * journal starts over from the new file.
+ */
+
+// ".name.swp" in the directory of the file
+char *journalPath(const char *filename)
+{
+    const char *base = strrchr(filename, '/');
+    int dirlen = base ? base - filename + 1 : 0;
+    char *path = malloc(strlen(filename) + 6);
+
+    base = base ? base + 1 : filename;
+    sprintf(path, "%.*s.%s.swp", dirlen, filename, base);
+
+    return path;
+}
+
+// the header for the file as it is on disk now
+int journalHeader(struct jhead *h)
+{
+    struct stat st;
+
+    if (stat(E.filename, &st) == -1)
+        return -1;
+
+    memset(h, 0, sizeof(*h));
+    memcpy(h->magic, "KILOJRN1", 8);
+    h->size = st.st_size;
+    h->mtime = st.st_mtime;
+    h->ino = st.st_ino;
+
+    return 0;
+}
+
+int journalWrite(int fd, const char *buf, long long len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        buf += n;
+        len -= n;
+    }
+
+    return 0;
+}
+
+// stop recording when the journal can't be written, saving still works
+void journalFail()
+{
+    editorSetStatusMessage("Journal off: %s", strerror(errno));
+
+    if (E.journal.fd != -1)
+        close(E.journal.fd);
+
+    E.journal.fd = -1;
+    E.journal.on = 0;
+    E.journal.len = 0;
+    E.journal.unsynced = 0;
+}
+
+void journalRecord(int op, int row, int at, const char *s, int len)
+{
+    struct jrec r = {op, row, at, len};
+    // without text len is only a count
+    int textlen = s ? len : 0;
+    int need = sizeof(r) + textlen;
+
+    if (!E.journal.on)
+        return;
+
+    if (E.journal.len + need > E.journal.cap)
+    {
+        E.journal.cap = E.journal.len + need > 2 * E.journal.cap ? E.journal.len + need : 2 * E.journal.cap;
+        E.journal.buf = realloc(E.journal.buf, E.journal.cap);
+    }
+
+    memcpy(&E.journal.buf[E.journal.len], &r, sizeof(r));
+    if (textlen)
+        memcpy(&E.journal.buf[E.journal.len + sizeof(r)], s, textlen);
+    E.journal.len += need;
+
+    if (!E.journal.unsynced)
+    {
+        E.journal.unsynced = 1;
+        E.journal.due = time(NULL) + KILO_JOURNAL_SYNC;
+    }
+
+    // a big paste doesn't wait for the end of the batch
+    if (E.journal.len >= KILO_JOURNAL_BUF)
+        journalFlush();
+}
+
+// write out the records collected so far, the journal is made on demand
+void journalFlush()
+{
+    if (E.journal.len == 0)
+        return;
+
+    if (E.journal.fd == -1)
+    {
+        struct jhead h;
+
+        if (journalHeader(&h) == -1 ||
+            (E.journal.fd = open(E.journal.path, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1 ||
+            journalWrite(E.journal.fd, (char *)&h, sizeof(h)) == -1)
+        {
+            journalFail();
+            return;
+        }
+
+        E.journal.pos = sizeof(h);
+    }
+
+    if (journalWrite(E.journal.fd, E.journal.buf, E.journal.len) == -1)
+    {
+        journalFail();
+        return;
+    }
+
+    E.journal.pos += E.journal.len;
+    E.journal.len = 0;
+}
+
+// called before the editor waits, the writes are batched per wakeup
+void journalTick()
+{
+    journalFlush();
+
+    if (E.journal.unsynced && time(NULL) >= E.journal.due)
+    {
+        if (E.journal.fd != -1)
+            fdatasync(E.journal.fd);
+        E.journal.unsynced = 0;
+    }
+}
+
+/**
+ * the file was saved with the edits up to "from" in the journal, so only
+ * the records behind it are kept, under a header for the new file
+ */
+void journalRebase(long long from)
+{
+    if (E.journal.kept)
+        return;
+
+    if (E.journal.path == NULL)
+        E.journal.path = journalPath(E.filename);
+
+    E.journal.on = 1;
+    journalFlush();
+
+    if (E.journal.fd == -1)
+        return;
+
+    // the old header is never carried over
+    if (from < (long long)sizeof(struct jhead))
+        from = sizeof(struct jhead);
+
+    // nothing left to recover, no journal
+    if (from >= E.journal.pos)
+    {
+        close(E.journal.fd);
+        unlink(E.journal.path);
+        E.journal.fd = -1;
+        E.journal.pos = 0;
+        E.journal.unsynced = 0;
+        return;
+    }
+
+    char *tmp = malloc(strlen(E.journal.path) + 8);
+    struct jhead h;
+    char buf[65536];
+    long long at = from;
+    int fd, ok;
+
+    sprintf(tmp, "%s.XXXXXX", E.journal.path);
+
+    fd = mkstemp(tmp);
+    ok = fd != -1 && journalHeader(&h) != -1 && journalWrite(fd, (char *)&h, sizeof(h)) != -1;
+
+    while (ok && at < E.journal.pos)
+    {
+        ssize_t n = pread(E.journal.fd, buf, sizeof(buf), at);
+
+        ok = n > 0 && journalWrite(fd, buf, n) != -1;
+        at += n;
+    }
+
+    if (ok && rename(tmp, E.journal.path) != -1)
+    {
+        close(E.journal.fd);
+        E.journal.fd = fd;
+        E.journal.pos = sizeof(h) + E.journal.pos - from;
+        free(tmp);
+        return;
+    }
+
+    if (fd != -1)
+    {
+        close(fd);
+        unlink(tmp);
+    }
+    free(tmp);
+    journalFail();
+}
+
+/**
+ * apply the records of a journal to the file, stops at the first one that
+ * is cut off or doesn't fit. Returns the bytes of journal used.
+ */
+long long journalReplay(char *buf, long long len, int *edits)
+{
+    long long at = sizeof(struct jhead);
+
+    *edits = 0;
+
+    while (at + (long long)sizeof(struct jrec) <= len)
+    {
+        struct jrec r;
+        char *text = &buf[at + sizeof(r)];
+
+        memcpy(&r, &buf[at], sizeof(r));
+
+        // a delete only counts the chars, it has no text
+        int textlen = (r.op == J_DELETE) ? 0 : r.len;
+
+        if (r.len < 0 || textlen > len - at - (long long)sizeof(r) || r.row < 0 || r.at < 0)
+            break;
+
+        int in = r.row < E.numrows;
+        int size = in ? editorRowAt(r.row)->size : 0;
+
+        if (r.op == J_INSERT_ROW && r.row <= E.numrows)
+            editorInsertRow(r.row, text, r.len);
+        else if (r.op == J_INSERT_ROWS && r.row <= E.numrows)
+            editorInsertRows(r.row, text, r.len);
+        else if (r.op == J_DEL_ROW && in)
+            editorDelRow(r.row);
+        else if (r.op == J_INSERT && in && r.at <= size)
+            editorRowInsertString(r.row, r.at, text, r.len);
+        else if (r.op == J_DEL_CHAR && in && r.at < size)
+            editorRowDelChar(r.row, r.at);
+        else if (r.op == J_TRUNCATE && in && r.at <= size)
+            editorRowTruncate(r.row, r.at);
+        else if (r.op == J_DELETE && in && r.at + r.len <= size)
+            editorRowDelString(r.row, r.at, r.len);
+        else if (r.op == J_SET_ROW && in)
+            editorRowSetText(r.row, editorRowCopy(text, r.len), r.len, r.len);
+        else
+            break;
+
+        at += sizeof(r) + textlen;
+        (*edits)++;
+    }
+
+    return at;
+}
+
+/**
+ * look for the journal of a crashed session on the file that was just
+ * opened and offer to replay it, then start recording
+ */
+void journalStart()
+{
+    struct jhead h, want;
+    struct stat st;
+
+    E.journal.path = journalPath(E.filename);
+    E.journal.on = 1;
+
+    int fd = open(E.journal.path, O_RDWR);
+
+    if (fd == -1)
+        return;
+
+    // a journal of some other version of the file is of no use
+    if (fstat(fd, &st) == -1 || st.st_size <= (off_t)sizeof(h) ||
+        read(fd, &h, sizeof(h)) != sizeof(h) || journalHeader(&want) == -1 ||
+        memcmp(&h, &want, sizeof(h)) != 0)
+    {
+        close(fd);
+        unlink(E.journal.path);
+        return;
+    }
+
+    char *answer = editorPrompt("Unsaved edits of this file were found, recover them? (y/n) %s", NULL, 0);
+    int yes = answer && (answer[0] == 'y' || answer[0] == 'Y');
+    int no = answer && (answer[0] == 'n' || answer[0] == 'N');
+
+    free(answer);
+
+    // only a plain no gives the edits up, anything else keeps them for next time
+    if (!yes)
+    {
+        close(fd);
+
+        if (no)
+        {
+            unlink(E.journal.path);
+            return;
+        }
+
+        E.journal.on = 0;
+        E.journal.kept = 1;
+        editorSetStatusMessage("Unsaved edits kept in %s, this session isn't journaled", E.journal.path);
+        return;
+    }
+
+    char *buf = malloc(st.st_size);
+    long long len = pread(fd, buf, st.st_size, 0);
+    int edits;
+
+    // the replayed edits are in the journal already
+    E.journal.on = 0;
+    len = journalReplay(buf, len < 0 ? 0 : len, &edits);
+    E.journal.on = 1;
+    free(buf);
+
+    // a record cut off by the crash is dropped, the next ones go after the rest
+    ftruncate(fd, len);
+    lseek(fd, len, SEEK_SET);
+    E.journal.fd = fd;
+    E.journal.pos = len;
+    E.dirty = edits;
+
+    editorSetStatusMessage("Recovered %d edits", edits);
+}
+
+/* undo */
+
+/**
+ * Undo keeps a log of the edits made by the row operations, each record
+ * holds what it takes to undo and redo it, so nothing is ever snapshotted.
+ * Keys are grouped, a word typed or erased is one group, anything else is
+ * a group of its own. Typing and erasing in a row extend the last record
+ * instead of adding one. Undoing a group walks its records backwards, so
+ * it takes time for that group only.
+ */
+
+// the text is padded, so the next record is aligned
+#define UREC_SIZE(r) ((((int)sizeof(struct urec) + (r)->len + (r)->len2 + 3) & ~3) + (int)sizeof(int))
+#define UREC_AT(off) ((struct urec *)&E.undo.log[off])
+#define UREC_TEXT(r) ((char *)(r) + sizeof(struct urec))
+
+// the record ending at off
+int undoPrev(int off)
+{
+    int size;
+
+    memcpy(&size, &E.undo.log[off - sizeof(int)], sizeof(int));
+    return off - size;
+}
+
+void undoAppend(struct urec *r, const char *s, const char *s2)
+{
+    int size = UREC_SIZE(r);
+
+    if (E.undo.len + size > E.undo.cap)
+    {
+        E.undo.cap = E.undo.len + size > 2 * E.undo.cap ? E.undo.len + size : 2 * E.undo.cap;
+        E.undo.log = realloc(E.undo.log, E.undo.cap);
+    }
+
+    char *p = &E.undo.log[E.undo.len];
+
+    memcpy(p, r, sizeof(*r));
+    if (r->len)
+        memcpy(p + sizeof(*r), s, r->len);
+    if (r->len2)
+        memcpy(p + sizeof(*r) + r->len, s2, r->len2);
+    memcpy(p + size - sizeof(int), &size, sizeof(int));
+
+    E.undo.last = E.undo.len;
+    E.undo.len += size;
+    E.undo.pos = E.undo.len;
+}
+
+/**
+ * drop the oldest groups until the log is down to 3/4 of KILO_UNDO_MAX.
+ * If the group being recorded is too big by itself, nothing is left.
+ */
+void undoTrim()
+{
+    int keep = KILO_UNDO_MAX / 4 * 3;
+    int off = 0;
+
+    while (off < E.undo.len && (E.undo.len - off > keep || UREC_AT(off)->op != U_GROUP))
+        off += UREC_SIZE(UREC_AT(off));
+
+    if (off == E.undo.len)
+    {
+        E.undo.overflow = 1;
+        editorSetStatusMessage("The edit is too big to undo");
+    }
+
+    memmove(E.undo.log, &E.undo.log[off], E.undo.len - off);
+    E.undo.len -= off;
+    E.undo.pos = E.undo.len;
+    E.undo.last = E.undo.last >= off ? E.undo.last - off : -1;
+}
+
+/**
+ * typing at the end of the last insert, or erasing next to the last
+ * delete, only grows that record
+ */
+int undoMerge(int op, int row, int at, const char *s, int len)
+{
+    struct urec *last;
+
+    if (E.undo.last == -1 || (op != U_INSERT && op != U_DELETE))
+        return 0;
+
+    last = UREC_AT(E.undo.last);
+
+    if (last->op != op || last->row != row)
+        return 0;
+
+    int append = op == U_INSERT ? at == last->at + last->len : at == last->at;
+    int prepend = op == U_DELETE && at + len == last->at;
+
+    if (!append && !prepend)
+        return 0;
+
+    // take the record off the log and put it back grown
+    struct urec r = *last;
+    char *text = malloc(r.len + len);
+
+    memcpy(prepend ? text + len : text, UREC_TEXT(last), r.len);
+    memcpy(prepend ? text : text + r.len, s, len);
+    E.undo.len = E.undo.last;
+
+    r.len += len;
+    if (prepend)
+        r.at = at;
+    undoAppend(&r, text, NULL);
+    free(text);
+
+    return 1;
+}
+
+void undoRecord(int op, int row, int at, const char *s, int len, const char *s2, int len2)
+{
+    if (E.undo.paused)
+        return;
+
+    // a new edit makes what was undone unreachable
+    if (E.undo.pos < E.undo.len)
+    {
+        E.undo.len = E.undo.pos;
+        E.undo.last = -1;
+    }
+
+    if (E.undo.boundary)
+    {
+        struct urec g = {U_GROUP, E.undo.cy, E.undo.cx, 0, 0};
+
+        E.undo.boundary = 0;
+        E.undo.overflow = 0;
+        undoAppend(&g, NULL, NULL);
+    }
+    else if (E.undo.overflow || undoMerge(op, row, at, s, len))
+        return;
+
+    struct urec r = {op, row, at, len, len2};
+
+    undoAppend(&r, s, s2);
+
+    if (E.undo.len > KILO_UNDO_MAX)
+        undoTrim();
+}
+
+// called with every key before it is handled, to see where groups start
+void undoKey(int c)
+{
+    int kind = UK_OTHER;
+
+    if (c == BACKSPACE || c == CTRL_KEY('h'))
+        kind = UK_BACK;
+    else if (c == DEL_KEY)
+        kind = UK_DEL;
+    else if (c == '\t' || (!iscntrl(c) && c < 128))
+        kind = UK_TYPE;
+
+    // a word and the spaces after it are one group
+    if (kind == UK_OTHER || kind != E.undo.kind ||
+        (kind == UK_TYPE && isspace(E.undo.lastc) && !isspace(c)))
+    {
+        E.undo.boundary = 1;
+        E.undo.cx = E.cx;
+        E.undo.cy = E.cy;
+        E.undo.last = -1;
+    }
+
+    E.undo.kind = kind;
+    E.undo.lastc = kind == UK_TYPE ? c : 0;
+}
+
+// apply a record, or undo it, and leave the cursor where it happened
+void undoApply(struct urec *r, int undo)
+{
+    char *text = UREC_TEXT(r);
+    int i;
+
+    E.cy = r->row;
+    E.cx = r->at;
+
+    switch (r->op)
+    {
+    case U_INSERT_ROW:
+        if (undo)
+            editorDelRow(r->row);
+        else
+            editorInsertRow(r->row, text, r->len);
+        E.cx = 0;
+        break;
+
+    case U_INSERT_ROWS:
+        if (undo)
+            for (i = 0; i < r->at; i++)
+                editorDelRow(r->row);
+        else
+            editorInsertRows(r->row, text, r->len);
+        E.cx = 0;
+        break;
+
+    case U_DEL_ROW:
+        if (undo)
+            editorInsertRow(r->row, text, r->len);
+        else
+            editorDelRow(r->row);
+        E.cx = 0;
+        break;
+
+    case U_INSERT:
+        if (undo)
+            editorRowDelString(r->row, r->at, r->len);
+        else
+            editorRowInsertString(r->row, r->at, text, r->len);
+        break;
+
+    case U_DELETE:
+        if (undo)
+            editorRowInsertString(r->row, r->at, text, r->len);
+        else
+            editorRowDelString(r->row, r->at, r->len);
+        break;
+
+    case U_TRUNCATE:
+        if (undo)
+            editorRowInsertString(r->row, r->at, text, r->len);
+        else
+            editorRowTruncate(r->row, r->at);
+        break;
+
+    case U_SET_ROW:
+        if (undo)
+            editorRowSetText(r->row, editorRowCopy(text, r->len), r->len, r->len);
+        else
+            editorRowSetText(r->row, editorRowCopy(text + r->len, r->len2), r->len2, r->len2);
+        E.cx = 0;
+        break;
+    }
+}
+
+void editorUndo()
+{
+    int off = E.undo.pos;
+
+    if (off == 0)
+    {
+        editorSetStatusMessage("Nothing to undo");
+        return;
+    }
+
+    E.undo.paused = 1;
+
+    // back to the marker the group starts with
+    while (off > 0)
+    {
+        off = undoPrev(off);
+
+        struct urec *r = UREC_AT(off);
+
+        if (r->op == U_GROUP)
+        {
+            E.cy = r->row;
+            E.cx = r->at;
+            break;
+        }
+
+        undoApply(r, 1);
+    }
+
+    E.undo.paused = 0;
+    E.undo.pos = off;
+    E.undo.last = -1;
+}
+
+void editorRedo()
+{
+    int off = E.undo.pos;
+
+    if (off == E.undo.len)
+    {
+        editorSetStatusMessage("Nothing to redo");
+        return;
+    }
+
+    E.undo.paused = 1;
+
+    // skip the marker, then on to the next one
+    off += UREC_SIZE(UREC_AT(off));
+
+    while (off < E.undo.len && UREC_AT(off)->op != U_GROUP)
+    {
+        struct urec *r = UREC_AT(off);
+
+        undoApply(r, 0);
+        if (r->op == U_INSERT)
+            E.cx += r->len;
+        off += UREC_SIZE(r);
+    }
+
+    E.undo.paused = 0;
+    E.undo.pos = off;
+    E.undo.last = -1;
+}
+
+/* regex */
+
+/**
+ * The regex search understands literals, ., [classes] with ranges, \d \w \s
+ * and \D \W \S, other escaped chars, ^ $, ( ), | and * + ?. A pattern is
+ * parsed and compiled into an NFA once per query, forwards and backwards.
+ * While rows are scanned, each search thread builds its own DFA from that
+ * NFA lazily, one state per set of NFA states actually reached, so a row is
+ * always scanned in linear time and nothing ever backtracks. ^ and $ are
+ * the symbols RE_BOL and RE_EOL that every row is read between.
+ */
+
+#define RE_BOL 256
+#define RE_EOL 257
+#define RE_NSYM 258
+
+enum reNodeType
+{
+    RN_EMPTY = 0,
+    RN_CLASS,
+    RN_CAT,
+    RN_ALT,
+    RN_STAR,
+    RN_PLUS,
+    RN_QUEST
+};
+
+enum reStateType
+{
+    RS_SYM = 0, // takes a symbol of its class to out
+    RS_SPLIT,   // goes to out and out1 without taking anything
+    RS_MATCH
+};
+
+struct reclass
+{
+    unsigned char bits[(RE_NSYM + 7) / 8];
+};
+
+#define RECLASS_HAS(c, sym) ((c)->bits[(sym) >> 3] & (1 << ((sym) & 7)))
+#define RECLASS_ADD(c, sym) ((c)->bits[(sym) >> 3] |= (1 << ((sym) & 7)))
+
+struct renode
+{
+    int type;
+    int cls;
+    int a, b;
+};
+
+struct restate
+{
+    int type;
+    int cls;
+    int out, out1;
+};
+
+struct regex
+{
+    struct reclass *cls;
+    int ncls;
+    struct renode *node;
+    int nnode;
+    // the NFA, and where it starts forwards and backwards
+    struct restate *st;
+    int nst;
+    int start[2];
+    // the parser
+    const char *p;
+    int error;
+};
+
+int reAddClass(struct regex *re)
+{
+    re->cls = realloc(re->cls, (re->ncls + 1) * sizeof(struct reclass));
+    memset(&re->cls[re->ncls], 0, sizeof(struct reclass));
+    return re->ncls++;
+}
+
+int reAddNode(struct regex *re, int type, int cls, int a, int b)
+{
+    re->node = realloc(re->node, (re->nnode + 1) * sizeof(struct renode));
+    re->node[re->nnode].type = type;
+    re->node[re->nnode].cls = cls;
+    re->node[re->nnode].a = a;
+    re->node[re->nnode].b = b;
+    return re->nnode++;
+}
+
+// add \d \w \s, or their opposites for \D \W \S, to a class
+int reEscapeClass(struct reclass *c, int e)
+{
+    int sym, neg = isupper(e) != 0;
+
+    e = tolower(e);
+    if (e != 'd' && e != 'w' && e != 's')
+        return 0;
+
+    for (sym = 0; sym < 256; sym++)
+    {
+        int in = e == 'd' ? isdigit(sym) != 0 : e == 'w' ? (isalnum(sym) || sym == '_') : isspace(sym) != 0;
+
+        if (in != neg)
+            RECLASS_ADD(c, sym);
+    }
+
+    return 1;
+}
+
+int reParseAlt(struct regex *re);
+
+// a bracket expression, the '[' is already taken
+int reParseClass(struct regex *re)
+{
+    int cls = reAddClass(re);
+    int neg = 0, first = 1, sym;
+    struct reclass c;
+
+    memset(&c, 0, sizeof(c));
+
+    if (*re->p == '^')
+    {
+        neg = 1;
+        re->p++;
+    }
+
+    while (*re->p && (*re->p != ']' || first))
+    {
+        int lo = (unsigned char)*re->p++, hi;
+
+        first = 0;
+
+        if (lo == '\\' && *re->p)
+        {
+            lo = (unsigned char)*re->p++;
+            if (reEscapeClass(&c, lo))
+                continue;
+        }
+
+        hi = lo;
+        if (re->p[0] == '-' && re->p[1] && re->p[1] != ']')
+        {
+            hi = (unsigned char)re->p[1];
+            re->p += 2;
+        }
+
+        for (sym = lo; sym <= hi; sym++)
+            RECLASS_ADD(&c, sym);
+    }
+
+    if (*re->p != ']')
+    {
+        re->error = 1;
+        return reAddNode(re, RN_EMPTY, 0, 0, 0);
+    }
+    re->p++;
+
+    for (sym = 0; sym < 256; sym++)
+        if ((RECLASS_HAS(&c, sym) != 0) != neg)
+            RECLASS_ADD(&re->cls[cls], sym);
+
+    return reAddNode(re, RN_CLASS, cls, 0, 0);
+}
+
+int reParseAtom(struct regex *re)
+{
+    int c = (unsigned char)*re->p++;
+    int cls, sym;
+
+    switch (c)
+    {
+    case '(':
+        {
+            int n = reParseAlt(re);
+
+            if (*re->p != ')')
+                re->error = 1;
+            else
+                re->p++;
+
+            return n;
+        }
+
+    case '[':
+        return reParseClass(re);
+
+    case '.':
+        cls = reAddClass(re);
+        for (sym = 0; sym < 256; sym++)
+            RECLASS_ADD(&re->cls[cls], sym);
+        return reAddNode(re, RN_CLASS, cls, 0, 0);
+
+    case '^':
+    case '$':
+        cls = reAddClass(re);
+        RECLASS_ADD(&re->cls[cls], c == '^' ? RE_BOL : RE_EOL);
+        return reAddNode(re, RN_CLASS, cls, 0, 0);
+
+    case '\\':
+        if (*re->p == '\0')
+        {
+            re->error = 1;
+            return reAddNode(re, RN_EMPTY, 0, 0, 0);
+        }
+
+        c = (unsigned char)*re->p++;
+        cls = reAddClass(re);
+        if (!reEscapeClass(&re->cls[cls], c))
+            RECLASS_ADD(&re->cls[cls], c);
+        return reAddNode(re, RN_CLASS, cls, 0, 0);
+
+    case '*':
+    case '+':
+    case '?':
+    case ')':
+    case '|':
+        // nothing to repeat, or an empty group
+        re->error = 1;
+        return reAddNode(re, RN_EMPTY, 0, 0, 0);
+
+    default:
+        cls = reAddClass(re);
+        RECLASS_ADD(&re->cls[cls], c);
+        return reAddNode(re, RN_CLASS, cls, 0, 0);
+    }
+}
+
+int reParseRepeat(struct regex *re)
+{
+    int n = reParseAtom(re);
+
+    while (*re->p == '*' || *re->p == '+' || *re->p == '?')
+    {
+        int c = *re->p++;
+
+        n = reAddNode(re, c == '*' ? RN_STAR : c == '+' ? RN_PLUS : RN_QUEST, 0, n, 0);
+    }
+
+    return n;
+}
+
+int reParseCat(struct regex *re)
+{
+    int n = reAddNode(re, RN_EMPTY, 0, 0, 0);
+
+    while (*re->p && *re->p != '|' && *re->p != ')' && !re->error)
+        n = reAddNode(re, RN_CAT, 0, n, reParseRepeat(re));
+
+    return n;
+}
+
+int reParseAlt(struct regex *re)
+{
+    int n = reParseCat(re);
+
+    while (*re->p == '|' && !re->error)
+    {
+        re->p++;
+        n = reAddNode(re, RN_ALT, 0, n, reParseCat(re));
+    }
+
+    return n;
+}
+
+int reAddState(struct regex *re, int type, int cls, int out, int out1)
+{
+    re->st = realloc(re->st, (re->nst + 1) * sizeof(struct restate));
+    re->st[re->nst].type = type;
+    re->st[re->nst].cls = cls;
+    re->st[re->nst].out = out;
+    re->st[re->nst].out1 = out1;
+    return re->nst++;
+}
+
+/**
+ * the NFA of node n going on to state next, the concatenations are turned
+ * around for the NFA that reads backwards
+ */
+int reCompile(struct regex *re, int n, int next, int reverse)
+{
+    struct renode node = re->node[n];
+    int s, body;
+
+    switch (node.type)
+    {
+    case RN_CLASS:
+        return reAddState(re, RS_SYM, node.cls, next, -1);
+    case RN_CAT:
+        if (reverse)
+            return reCompile(re, node.b, reCompile(re, node.a, next, reverse), reverse);
+        return reCompile(re, node.a, reCompile(re, node.b, next, reverse), reverse);
+    case RN_ALT:
+        s = reCompile(re, node.a, next, reverse);
+        return reAddState(re, RS_SPLIT, 0, s, reCompile(re, node.b, next, reverse));
+    case RN_QUEST:
+        s = reCompile(re, node.a, next, reverse);
+        return reAddState(re, RS_SPLIT, 0, s, next);
+    case RN_STAR:
+    case RN_PLUS:
+        // the loop goes back to the split, a star can skip the body
+        s = reAddState(re, RS_SPLIT, 0, -1, next);
+        body = reCompile(re, node.a, s, reverse);
+        re->st[s].out = body;
+        return node.type == RN_STAR ? s : body;
+    default:
+        return next;
+    }
+}
+
+void regexFree(struct regex *re)
+{
+    if (re == NULL)
+        return;
+
+    free(re->cls);
+    free(re->node);
+    free(re->st);
+    free(re);
+}
+
+// compile a pattern, NULL if it is not a valid one
+struct regex *regexCompile(const char *pattern)
+{
+    struct regex *re = calloc(1, sizeof(struct regex));
+    int root, match;
+
+    re->p = pattern;
+    root = reParseAlt(re);
+
+    if (re->error || *re->p)
+    {
+        regexFree(re);
+        return NULL;
+    }
+
+    match = reAddState(re, RS_MATCH, 0, -1, -1);
+    re->start[0] = reCompile(re, root, match, 0);
+    re->start[1] = reCompile(re, root, match, 1);
+
+    return re;
+}
+
+// the most states a DFA keeps before it starts over
+#define KILO_DFA_STATES 1024
+
+struct dstate
+{
+    int *set; // the NFA states, sorted
+    int nset;
+    int accept;
+    int next[RE_NSYM]; // -1 until the transition is needed
+};
+
+struct dfa
+{
+    const struct regex *re;
+    int reverse;
+    int unanchored; // the start states are added back after every symbol
+    struct dstate *st;
+    int nst;
+    int *hash; // 2 * KILO_DFA_STATES slots of state index + 1, 0 if free
+    int start;
+    // scratch for building sets
+    int *stack;
+    int *work;
+    unsigned int *mark;
+    unsigned int gen;
+    int resets; // the states were numbered again this many times
+};
+
+void dfaReset(struct dfa *d);
+
+void dfaInit(struct dfa *d, const struct regex *re, int reverse, int unanchored)
+{
+    d->re = re;
+    d->reverse = reverse;
+    d->unanchored = unanchored;
+    d->st = malloc(KILO_DFA_STATES * sizeof(struct dstate));
+    d->nst = 0;
+    d->hash = calloc(2 * KILO_DFA_STATES, sizeof(int));
+    d->stack = malloc(re->nst * sizeof(int));
+    d->work = malloc(re->nst * sizeof(int));
+    d->mark = calloc(re->nst, sizeof(unsigned int));
+    d->gen = 0;
+    d->resets = 0;
+
+    dfaReset(d);
+}
+
+void dfaFree(struct dfa *d)
+{
+    int i;
+
+    for (i = 0; i < d->nst; i++)
+        free(d->st[i].set);
+
+    free(d->st);
+    free(d->hash);
+    free(d->stack);
+    free(d->work);
+    free(d->mark);
+}
+
+// add the states reachable from s without taking a symbol to work
+void dfaClosure(struct dfa *d, int s, int *n)
+{
+    int top = 0;
+
+    d->stack[top++] = s;
+
+    while (top)
+    {
+        s = d->stack[--top];
+
+        if (s < 0 || d->mark[s] == d->gen)
+            continue;
+
+        d->mark[s] = d->gen;
+
+        if (d->re->st[s].type == RS_SPLIT)
+        {
+            d->stack[top++] = d->re->st[s].out1;
+            d->stack[top++] = d->re->st[s].out;
+        }
+        else
+        {
+            d->work[(*n)++] = s;
+        }
+    }
+}
+
+int intCompare(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+// the DFA state for the set of NFA states in work
+int dfaState(struct dfa *d, int n)
+{
+    unsigned int h = 2166136261u;
+    int i, slot;
+
+    qsort(d->work, n, sizeof(int), intCompare);
+
+    for (i = 0; i < n; i++)
+        h = (h ^ d->work[i]) * 16777619u;
+
+    for (slot = h % (2 * KILO_DFA_STATES); d->hash[slot]; slot = (slot + 1) % (2 * KILO_DFA_STATES))
+    {
+        struct dstate *st = &d->st[d->hash[slot] - 1];
+
+        if (st->nset == n && !memcmp(st->set, d->work, n * sizeof(int)))
+            return d->hash[slot] - 1;
+    }
+
+    struct dstate *st = &d->st[d->nst];
+
+    st->set = malloc((n ? n : 1) * sizeof(int));
+    memcpy(st->set, d->work, n * sizeof(int));
+    st->nset = n;
+    st->accept = 0;
+    for (i = 0; i < n; i++)
+        if (d->re->st[d->work[i]].type == RS_MATCH)
+            st->accept = 1;
+    for (i = 0; i < RE_NSYM; i++)
+        st->next[i] = -1;
+
+    d->hash[slot] = d->nst + 1;
+    return d->nst++;
+}
+
+// forget every state, only the start state is built again
+void dfaReset(struct dfa *d)
+{
+    int i, n = 0;
+
+    for (i = 0; i < d->nst; i++)
+        free(d->st[i].set);
+
+    d->nst = 0;
+    d->resets++;
+    memset(d->hash, 0, 2 * KILO_DFA_STATES * sizeof(int));
+
+    d->gen++;
+    dfaClosure(d, d->re->start[d->reverse], &n);
+    d->start = dfaState(d, n);
+}
+
+// the state after taking sym in state s, the states are built when first needed
+int dfaNext(struct dfa *d, int s, int sym)
+{
+    struct dstate *st = &d->st[s];
+    int i, n = 0;
+
+    if (st->next[sym] >= 0)
+        return st->next[sym];
+
+    d->gen++;
+
+    for (i = 0; i < st->nset; i++)
+    {
+        const struct restate *ns = &d->re->st[st->set[i]];
+
+        if (ns->type == RS_SYM && RECLASS_HAS(&d->re->cls[ns->cls], sym))
+            dfaClosure(d, ns->out, &n);
+    }
+
+    if (d->unanchored)
+        dfaClosure(d, d->re->start[d->reverse], &n);
+
+    // the cache is full, start over with what is in work
+    if (d->nst == KILO_DFA_STATES)
+    {
+        int *keep = malloc((n ? n : 1) * sizeof(int));
+
+        memcpy(keep, d->work, n * sizeof(int));
+        dfaReset(d);
+        memcpy(d->work, keep, n * sizeof(int));
+        free(keep);
+
+        return dfaState(d, n);
+    }
+
+    int next = dfaState(d, n);
+
+    d->st[s].next[sym] = next;
+    return next;
+}
+
+// whether no match can come out of state s any more
+#define DFA_DEAD(d, s) ((d)->st[s].nset == 0)
+
+/* find */
+
+/**
+ * The search never moves the gap of a row, it looks at both halves of the
+ * text and at the few bytes around the gap. Rows that still point into the
+ * mapped file and follow each other there are searched as one block with a
+ * single memmem(), so a big file is scanned at the speed of memmem() instead
+ * of paying for a call per row. The query never has a line ending in it, so
+ * no match can run from one row into the next.
+ */
+
+// the first match of q in row at column "from" or behind it, -1 if none
+int searchRow(erow *row, const char *q, int qlen, int from)
+{
+    char *match;
+
+    if (qlen == 0 || from + qlen > row->size)
+        return -1;
+
+    if (from < row->gap)
+    {
+        // the text before the gap
+        match = memmem(&row->chars[from], row->gap - from, q, qlen);
+        if (match)
+            return match - row->chars;
+
+        // a match running across the gap
+        if (row->gap < row->size && qlen > 1)
+        {
+            int start = row->gap - qlen + 1 > from ? row->gap - qlen + 1 : from;
+            int end = row->gap + qlen - 1 < row->size ? row->gap + qlen - 1 : row->size;
+            char window[2 * qlen];
+            int j;
+
+            for (j = start; j < end; j++)
+                window[j - start] = ROW_CHAR(row, j);
+
+            match = memmem(window, end - start, q, qlen);
+            if (match)
+                return start + (match - window);
+        }
+
+        from = row->gap;
+    }
+
+    // the text behind the gap
+    char *after = &row->chars[row->gap + row->gaplen];
+
+    match = memmem(&after[from - row->gap], row->size - from, q, qlen);
+
+    return match ? row->gap + (match - after) : -1;
+}
+
+// step to the next row of the leaf list
+#define ROW_NEXT(leaf, pos)        \
+    do                             \
+    {                              \
+        if (++(pos) == (leaf)->n)  \
+        {                          \
+            (leaf) = (leaf)->next; \
+            (pos) = 0;             \
+        }                          \
+    } while (0)
+
+// whether row b comes right after row a in the mapped file
+int searchAdjacent(erow *a, erow *b)
+{
+    char *p;
+
+    if (!(a->flags & ROW_MAPPED) || !(b->flags & ROW_MAPPED) || b->chars < a->chars + a->size)
+        return 0;
+
+    // only line endings are between them
+    for (p = a->chars + a->size; p < b->chars; p++)
+        if ((*p != '\n' && *p != '\r') || p - (a->chars + a->size) > 8)
+            return 0;
+
+    return 1;
+}
+
+void matchAppend(struct matchlist *list, int row, int col, int len)
+{
+    if (list->n == list->cap)
+    {
+        list->cap = list->cap ? list->cap * 2 : 64;
+        list->m = realloc(list->m, list->cap * sizeof(struct match));
+    }
+
+    list->m[list->n].row = row;
+    list->m[list->n].col = col;
+    list->m[list->n].len = len;
+    list->n++;
+}
+
+// the symbol k of a row read by the regex, the chars are between RE_BOL and RE_EOL
+#define ROW_SYM(row, k) \
+    ((k) == 0 ? RE_BOL : (k) > (row)->size ? RE_EOL : (unsigned char)ROW_CHAR(row, (k) - 1))
+
+// the slot of (pos, state) in the memo, a free one if it isn't there
+struct rememo *reMemoSlot(struct rescan *sc, int pos, int state)
+{
+    unsigned int h = ((unsigned int)pos * 2654435761u) ^ ((unsigned int)state * 40503u);
+    struct rememo *m;
+
+    for (h &= sc->memocap - 1;; h = (h + 1) & (sc->memocap - 1))
+    {
+        m = &sc->memo[h];
+
+        if (m->gen != sc->gen || (m->pos == pos && m->state == state))
+            return m;
+    }
+}
+
+// forget what was remembered, for another row or after the DFA started over
+void reMemoClear(struct rescan *sc, int resets)
+{
+    if (++sc->gen == 0)
+    {
+        memset(sc->memo, 0, sc->memocap * sizeof(struct rememo));
+        sc->gen = 1;
+    }
+
+    sc->memon = 0;
+    sc->resets = resets;
+}
+
+void reMemoAdd(struct rescan *sc, int pos, int state, int end)
+{
+    struct rememo *m;
+    int i;
+
+    // keep the table at most half full
+    if (2 * (sc->memon + 1) > sc->memocap)
+    {
+        struct rememo *old = sc->memo;
+        int oldcap = sc->memocap;
+
+        sc->memocap = oldcap ? 2 * oldcap : 1024;
+        sc->memo = calloc(sc->memocap, sizeof(struct rememo));
+
+        for (i = 0; i < oldcap; i++)
+        {
+            if (old[i].gen == sc->gen)
+                *reMemoSlot(sc, old[i].pos, old[i].state) = old[i];
+        }
+
+        free(old);
+    }
+
+    m = reMemoSlot(sc, pos, state);
+
+    if (m->gen != sc->gen)
+        sc->memon++;
+
+    m->gen = sc->gen;
+    m->pos = pos;
+    m->state = state;
+    m->end = end;
+}
+
+// a search that is cancelled is checked for every KILO_SEARCH_BLOCK steps of the DFAs
+#define RE_CANCELLED(steps) \
+    ((++(steps) & (KILO_SEARCH_BLOCK - 1)) == 0 && __atomic_load_n(&E.search.cancel, __ATOMIC_RELAXED))
+
+/**
+ * find the matches of a regex in a row. Reading the row backwards once with
+ * the reversed DFA tells every symbol a match starts at, then the forward
+ * DFA finds the longest match from the leftmost start, and so on behind it.
+ * The forward runs from different starts soon end up in the same state at
+ * the same symbol, and from there on they would read the same, so every
+ * (symbol, state) a run went through is remembered with the furthest match
+ * end behind it. A later run stops as soon as it gets to one of them, which
+ * keeps the whole row linear in its length.
+ */
+void searchRegexRow(struct matchlist *list, struct dfa *fwd, struct dfa *rev,
+                    struct rescan *sc, erow *row, int filerow)
+{
+    int nsym = row->size + 2;
+    int k, j, s, last, prev = -1;
+    unsigned int steps = 0;
+
+    if (nsym > sc->cap)
+    {
+        sc->cap = nsym;
+        sc->starts = realloc(sc->starts, sc->cap);
+        sc->path = realloc(sc->path, 2 * sc->cap * sizeof(int));
+    }
+
+    reMemoClear(sc, fwd->resets);
+
+    for (s = rev->start, k = nsym - 1; k >= 0; k--)
+    {
+        if (RE_CANCELLED(steps))
+            return;
+
+        s = dfaNext(rev, s, ROW_SYM(row, k));
+        sc->starts[k] = rev->st[s].accept;
+    }
+
+    for (k = 0; k < nsym; k++)
+    {
+        if (!sc->starts[k])
+            continue;
+
+        // the state numbers the memo has are no good after the DFA started over
+        if (fwd->resets != sc->resets)
+            reMemoClear(sc, fwd->resets);
+
+        int npath = 0;
+        int found = -1;
+
+        s = fwd->start;
+        last = fwd->st[s].accept ? k : -1;
+
+        for (j = k; j < nsym; j++)
+        {
+            if (RE_CANCELLED(steps))
+                return;
+
+            s = dfaNext(fwd, s, ROW_SYM(row, j));
+
+            if (DFA_DEAD(fwd, s))
+                break;
+
+            // another run went on from here already
+            if (sc->memon && fwd->resets == sc->resets)
+            {
+                struct rememo *m = reMemoSlot(sc, j + 1, s);
+
+                if (m->gen == sc->gen)
+                {
+                    found = m->end;
+                    break;
+                }
             }
+
+            sc->path[2 * npath] = j + 1;
+            sc->path[2 * npath + 1] = s;
+            npath++;
+
+            if (fwd->st[s].accept)
+                last = j + 1;
         }
 
-        prev_sep = is_separator(c);
-        i++;
+        if (found > last)
+            last = found;
+
+        // the furthest end from every step of this run, for the runs behind it
+        if (fwd->resets == sc->resets)
+        {
+            for (j = npath - 1; j >= 0; j--)
+            {
+                if (found == -1 && fwd->st[sc->path[2 * j + 1]].accept)
+                    found = sc->path[2 * j];
+
+                reMemoAdd(sc, sc->path[2 * j], sc->path[2 * j + 1], found);
+            }
+        }
+
+        if (last == -1)
+            continue;
+
+        // turn the symbols into columns, RE_BOL and RE_EOL take none
+        int col = k == 0 ? 0 : k - 1;
+        int end = last <= 1 ? 0 : last - 1;
+
+        if (col > row->size)
+            col = row->size;
+        if (end > row->size)
+            end = row->size;
+
+        /**
+         * the start at RE_BOL and the one at the first char are both column
+         * 0, the empty match before the row mustn't hide the longer one
+         */
+        if (col != prev)
+            matchAppend(list, filerow, col, end - col);
+        else if (end - col > list->m[list->n - 1].len)
+            list->m[list->n - 1].len = end - col;
+        prev = col;
+
+        if (last > k + 1)
+            k = last - 1;
     }
+}
 
-    int changed = (row->hl_open_comment != in_comment);
+void searchRegexRows(struct searchjob *job)
+{
+    struct dfa fwd, rev;
+    struct rescan scan;
+    struct rownode *leaf;
+    int pos, from = job->from;
 
-    row->hl_open_comment = in_comment;
+    if (from >= job->to)
+        return;
 
-    if(changed && row->idx + 1 < E.numrows)
-        editorUpdateSyntax(&E.row[row->idx + 1]);
-}
+    dfaInit(&fwd, job->re, 0, 0);
+    dfaInit(&rev, job->re, 1, 1);
+    memset(&scan, 0, sizeof(scan));
+    leaf = rowTreeFind(from, &pos);
 
-int editorSyntaxToColor(int hl)
-{
-    switch(hl)
+    for (; from < job->to; from++)
     {
-    case HL_COMMENT:
-    case HL_MLCOMMENT:
-        return 36; // blue
-    case HL_KEYWORD1:
-        return 33; // yellow
-    case HL_KEYWORD2:
-        return 32; // green
-    case HL_STRING:
-        return 35; // purple
-    case HL_NUMBER:
-        return 31; // red
-    case HL_MATCH:
-        return 34; // green
+        erow tmp;
+        erow *row = rowLeafPeek(leaf, pos, &tmp);
 
-    default:
-        return 37;
+        if (__atomic_load_n(&E.search.cancel, __ATOMIC_RELAXED))
+            break;
+
+        searchRegexRow(&job->list, &fwd, &rev, &scan, row, from);
+        ROW_NEXT(leaf, pos);
     }
+
+    free(scan.starts);
+    free(scan.memo);
+    free(scan.path);
+    dfaFree(&fwd);
+    dfaFree(&rev);
 }
 
-void editorSelectSyntaxHighlight()
+/**
+ * find every match of the query in the rows of a job, in order. It stops
+ * early when the search is cancelled, which is checked between rows and
+ * between blocks of at most KILO_SEARCH_BLOCK bytes
+ */
+void searchRows(struct searchjob *job)
 {
-    E.syntax = NULL;
+    const char *q = job->q;
+    int qlen = job->qlen;
+    int from = job->from, to = job->to;
+    struct rownode *leaf;
+    int pos, col;
+    erow tmp[3]; // the rows of leaves that only have their lines
+
+    if (job->re)
+    {
+        searchRegexRows(job);
+        return;
+    }
 
-    if(E.filename == NULL)
+    if (from >= to || qlen == 0)
         return;
 
-    // return a pointer to the last occurrence of character ('.')
-    // Example: hello.c, it will return .c
-    char *ext = strrchr(E.filename, '.');
+    leaf = rowTreeFind(from, &pos);
 
-    for(unsigned int j = 0; j < HLDB_ENTRIES; j++)
+    while (from < to)
     {
-        struct editorSyntax *s = &HLDB[j];
-        unsigned int i = 0;
+        erow *row = rowLeafPeek(leaf, pos, &tmp[0]);
 
-        while(s->filematch[i])
+        if (__atomic_load_n(&E.search.cancel, __ATOMIC_RELAXED))
+            return;
+
+        if (!(row->flags & ROW_MAPPED))
         {
-            int is_ext = (s->filematch[i][0] == '.');
+            for (col = searchRow(row, q, qlen, 0); col != -1; col = searchRow(row, q, qlen, col + 1))
+                matchAppend(&job->list, from, col, qlen);
 
-            if((is_ext && ext && !strcmp(ext, s->filematch[i])) ||
-               (!is_ext && strstr(E.filename, s->filematch[i])))
+            ROW_NEXT(leaf, pos);
+            from++;
+            continue;
+        }
+
+        // the block of rows back to back in the mapped file, [row, last]
+        struct rownode *lleaf = leaf;
+        int lpos = pos, n = 1;
+        erow *last = row;
+
+        while (from + n < to && last->chars + last->size - row->chars < KILO_SEARCH_BLOCK)
+        {
+            struct rownode *nleaf = lleaf;
+            int npos = lpos;
+
+            ROW_NEXT(nleaf, npos);
+
+            erow *next = rowLeafPeek(nleaf, npos, &tmp[2]);
+            if (!searchAdjacent(last, next))
+                break;
+
+            if (next == &tmp[2])
             {
-                E.syntax = s;
+                tmp[1] = tmp[2];
+                next = &tmp[1];
+            }
 
-                int filerow;
-                for(filerow = 0; filerow < E.numrows; filerow++)
-                {
-                    editorUpdateSyntax(&E.row[filerow]);
-                }
+            lleaf = nleaf;
+            lpos = npos;
+            last = next;
+            n++;
+        }
 
-                return;
+        char *p = row->chars;
+        char *end = last->chars + last->size;
+        char *match;
+
+        // the rows are walked along with the matches to tell where they are
+        while ((match = memmem(p, end - p, q, qlen)))
+        {
+            while (match >= row->chars + row->size)
+            {
+                ROW_NEXT(leaf, pos);
+                row = rowLeafPeek(leaf, pos, &tmp[0]);
+                from++;
+                n--;
             }
 
-            i++;
+            matchAppend(&job->list, from, match - row->chars, qlen);
+            p = match + 1;
         }
+
+        leaf = lleaf;
+        pos = lpos;
+        ROW_NEXT(leaf, pos);
+        from += n;
     }
 }
 
-/* row operations */
-
-// convert the chars index into a render index, the cursor would jump to the
-// beginning of next word if there is a '\t'
-int editorRowCxToRx(erow *row, int cx)
+/**
+ * take the next piece of the rows off the cursor of the pool, with the lock
+ * held. Returns its index, or -1 when there's none left
+ */
+int searchClaim(struct searchjob *job)
 {
-    int rx = 0;
-    int j;
+    struct searchpool *p = &E.search.pool;
+    long long bytes = 0;
 
-    for (j = 0; j < cx; j++)
+    if (p->row >= E.numrows || __atomic_load_n(&E.search.cancel, __ATOMIC_RELAXED))
+        return -1;
+
+    job->from = p->row;
+
+    while (p->row < E.numrows && bytes < KILO_SEARCH_BLOCK)
     {
-        if (row->chars[j] == '\t')
-        {
-            /**
-             * (rx % KILO_TAB_STOP) find out how many columns we are to the right of the last tab stop
-             * (KILO_TAB_STOP - 1) find out how many colunmns we are to the left of the next tab stop
-             */
-            rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-        }
+        erow tmp;
 
-        // gets us right on the next tab stop
-        rx++;
+        bytes += rowLeafPeek(p->leaf, p->pos, &tmp)->size + 1;
+        ROW_NEXT(p->leaf, p->pos);
+        p->row++;
     }
 
-    return rx;
+    job->to = p->row;
+    job->q = E.search.query;
+    job->qlen = E.search.qlen;
+    job->re = E.search.re;
+    job->list.m = NULL;
+    job->list.n = job->list.cap = 0;
+
+    if (p->njobs == p->jobcap)
+    {
+        p->jobcap = p->jobcap ? p->jobcap * 2 : 64;
+        p->jobs = realloc(p->jobs, p->jobcap * sizeof(struct searchjob));
+    }
+
+    p->jobs[p->njobs] = *job;
+
+    return p->njobs++;
 }
 
-int editorRowRxToCx(erow *row, int rx)
+// search pieces of the rows until there are none left, with the lock held
+void searchWork()
 {
-    int cur_rx = 0;
-    int cx;
+    struct searchpool *p = &E.search.pool;
+    struct searchjob job;
+    int i;
 
-    for(cx = 0; cx < row->size; cx++)
+    while ((i = searchClaim(&job)) != -1)
     {
-        if(row->chars[cx] == '\t')
-            cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
-
-        cur_rx++;
+        pthread_mutex_unlock(&p->lock);
+        searchRows(&job);
+        __atomic_add_fetch(&E.search.done, job.to - job.from, __ATOMIC_RELAXED);
+        pthread_mutex_lock(&p->lock);
 
-        if(cur_rx > rx)
-            return cx;
+        p->jobs[i].list = job.list;
     }
-
-    return cx;
 }
 
-void editorUpdateRow(erow *row)
+void *searchWorker(void *arg)
 {
-    int tabs = 0;
-    int j;
+    struct searchpool *p = &E.search.pool;
+    unsigned int gen = 0;
 
-    for (j = 0; j < row->size; j++)
-        if (row->chars[j] == '\t')
-            tabs++;
+    (void)arg;
 
-    free(row->render);
-    row->render = malloc(row->size + tabs * (KILO_TAB_STOP - 1) + 1);
+    pthread_mutex_lock(&p->lock);
 
-    int idx = 0;
-    for (j = 0; j < row->size; j++)
+    while (1)
     {
-        if (row->chars[j] == '\t')
-        {
-            row->render[idx++] = ' ';
+        while (p->gen == gen)
+            pthread_cond_wait(&p->wake, &p->lock);
+        gen = p->gen;
 
-            while (idx % KILO_TAB_STOP != 0)
-                row->render[idx++] = ' ';
-        }
-        else
+        searchWork();
+
+        // the last one wakes up the input loop to pick the matches up
+        if (--p->busy == 0)
         {
-            row->render[idx++] = row->chars[j];
+            pthread_cond_signal(&p->idle);
+            write(E.sigpipe[1], "s", 1);
         }
     }
 
-    row->render[idx] = '\0';
-    row->rsize = idx;
-
-    editorUpdateSyntax(row);
+    return NULL;
 }
 
-void editorInsertRow(int at, char *s, size_t len)
+// the threads of the pool, they are started the first time, 0 if none could be
+int searchThreads()
 {
-    if (at < 0 || at > E.numrows)
-        return;
+    struct searchpool *p = &E.search.pool;
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
 
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
+    if (p->nthreads)
+        return p->nthreads;
 
-    for(int j = at + 1; j <= E.numrows; j++)
-        E.row[j].idx++;
+    if (n > KILO_SEARCH_THREADS)
+        n = KILO_SEARCH_THREADS;
 
-    E.row[at].idx = at;
+    while (p->nthreads < n && pthread_create(&p->tid[p->nthreads], NULL, searchWorker, NULL) == 0)
+        p->nthreads++;
+
+    return p->nthreads;
+}
+
+/**
+ * whether the file is small enough to be searched without a thread, it
+ * stops counting the bytes as soon as they're too many
+ */
+int searchSmall()
+{
+    long long bytes = 0;
+    int pos;
 
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
+    if (E.numrows >= KILO_SEARCH_MIN_ROWS)
+        return 0;
 
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    E.row[at].hl = NULL;
-    E.row[at].hl_open_comment = 0;
-    editorUpdateRow(&E.row[at]);
+    for (struct rownode *leaf = rowTreeFind(0, &pos); leaf && bytes < KILO_SEARCH_SYNC; leaf = leaf->next)
+    {
+        for (pos = 0; pos < leaf->n; pos++)
+        {
+            erow tmp;
 
-    E.numrows++;
-    E.dirty++;
+            bytes += rowLeafPeek(leaf, pos, &tmp)->size + 1;
+        }
+    }
+
+    return bytes < KILO_SEARCH_SYNC;
 }
 
-void editorFreeRow(erow *row)
+void searchSetQuery(const char *q, int qlen)
 {
-    free(row->render);
-    free(row->chars);
-    free(row->hl);
+    free(E.search.query);
+    E.search.query = malloc(qlen + 1);
+    memcpy(E.search.query, q, qlen + 1);
+    E.search.qlen = qlen;
+    E.search.current = -1;
+    E.search.gen++;
 }
 
-void editorDelRow(int at)
+// wait for the threads and join the pieces they found, in order, into the index
+void searchJoin()
 {
-    if (at < 0 || at >= E.numrows)
-        return;
+    struct searchpool *p = &E.search.pool;
+    int t;
 
-    editorFreeRow(&E.row[at]);
-    // overwrite the current row by shifting the next and the rest of the rows
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
+    pthread_mutex_lock(&p->lock);
+    while (p->busy)
+        pthread_cond_wait(&p->idle, &p->lock);
+    pthread_mutex_unlock(&p->lock);
 
-    for(int j = at; j < E.numrows - 1; j++)
-        E.row[j].idx--;
+    E.search.found.n = 0;
 
-    // decrement the total row of the file
-    E.numrows--;
-    E.dirty++;
-}
+    for (t = 0; t < p->njobs; t++)
+    {
+        struct matchlist *list = &p->jobs[t].list;
 
-void editorRowInsertChar(erow *row, int at, int c)
-{
-    if (at < 0 || at > row->size)
-        at = row->size;
+        if (E.search.found.n + list->n > E.search.found.cap)
+        {
+            E.search.found.cap = E.search.found.n + list->n;
+            E.search.found.m = realloc(E.search.found.m, E.search.found.cap * sizeof(struct match));
+        }
 
-    // 1 byte for new character and 1 byte for \0
-    row->chars = realloc(row->chars, row->size + 2);
-    // safer than memcpy when the source and destination arrays overlap
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    E.dirty++;
-}
+        if (list->n)
+            memcpy(&E.search.found.m[E.search.found.n], list->m, list->n * sizeof(struct match));
+        E.search.found.n += list->n;
+        free(list->m);
+    }
 
-void editorRowAppenedString(erow *row, char *s, size_t len)
-{
-    // including '\0'
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+    p->njobs = 0;
+    E.search.running = 0;
 }
 
-void editorRowDelChar(erow *row, int at)
+// cancel the search that is still running
+void searchStop()
 {
-    if (at < 0 || at >= row->size)
+    if (!E.search.running)
         return;
 
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
-}
+    __atomic_store_n(&E.search.cancel, 1, __ATOMIC_RELAXED);
+    searchJoin();
+    __atomic_store_n(&E.search.cancel, 0, __ATOMIC_RELAXED);
 
-/* editor operations */
+    E.search.found.n = 0;
+}
 
-void editorInsertChar(int c)
+// drop the regex and the DFAs the screen used for it
+void searchFreeRe()
 {
-    // whether the cursor is on the tilde line after the end of the file
-    if (E.cy == E.numrows)
+    if (E.search.fwd)
     {
-        // append a new row to the file before insertinga character there
-        editorInsertRow(E.numrows, "", 0);
+        dfaFree(E.search.fwd);
+        dfaFree(E.search.rev);
+        free(E.search.fwd);
+        free(E.search.rev);
+        E.search.fwd = E.search.rev = NULL;
     }
 
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+    regexFree(E.search.re);
+    E.search.re = NULL;
 }
 
-void editorInsertNewline()
+/**
+ * the matches of the query in a row on the screen, they are kept in the row
+ * until the query or the row changes, so scrolling doesn't search again
+ */
+int *searchRowMatches(erow *row)
 {
-    if (E.cx == 0)
+    struct matchlist list = {NULL, 0, 0};
+    int col, i;
+
+    if (row->matches && (unsigned int)row->matches[0] == E.search.gen)
+        return row->matches;
+
+    if (E.search.re)
     {
-        editorInsertRow(E.cy, "", 0);
+        if (E.search.fwd == NULL)
+        {
+            E.search.fwd = malloc(sizeof(struct dfa));
+            E.search.rev = malloc(sizeof(struct dfa));
+            dfaInit(E.search.fwd, E.search.re, 0, 0);
+            dfaInit(E.search.rev, E.search.re, 1, 1);
+        }
+
+        searchRegexRow(&list, E.search.fwd, E.search.rev, &E.search.scan, row, 0);
     }
-    else
+    else if (!E.search.regex)
     {
-        erow *row = &E.row[E.cy];
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
+        for (col = searchRow(row, E.search.query, E.search.qlen, 0); col != -1;
+             col = searchRow(row, E.search.query, E.search.qlen, col + 1))
+            matchAppend(&list, 0, col, E.search.qlen);
     }
 
-    E.cy++;
-    E.cx = 0;
+    row->matches = realloc(row->matches, (2 + 2 * list.n) * sizeof(int));
+    row->matches[0] = E.search.gen;
+    row->matches[1] = list.n;
+
+    for (i = 0; i < list.n; i++)
+    {
+        row->matches[2 + 2 * i] = list.m[i].col;
+        row->matches[3 + 2 * i] = list.m[i].len;
+    }
+
+    free(list.m);
+    return row->matches;
 }
 
-void editorDelChar()
+/**
+ * start looking for every match of the query in the file. A small file is
+ * searched right away, anything else, also a few long rows, is handed to
+ * the threads of the pool, which only read the rows and run while the
+ * prompt goes on, searchPoll() picks their matches up. Nothing edits the
+ * rows while the prompt is open. Drawing may still build render and hl, but
+ * those and their rflags are never read by the threads, and editorRowText()
+ * leaves the gap where it is while they run
+ */
+void searchStart(const char *q, int qlen)
 {
-    if (E.cy == E.numrows)
-        return;
+    struct searchpool *p = &E.search.pool;
 
-    if (E.cx == 0 && E.cy == 0)
+    searchStop();
+    searchSetQuery(q, qlen);
+    E.search.found.n = 0;
+
+    searchFreeRe();
+
+    if (E.search.regex && qlen && (E.search.re = regexCompile(q)) == NULL)
         return;
 
-    erow *row = &E.row[E.cy];
+    pthread_mutex_lock(&p->lock);
 
-    if (E.cx > 0)
+    p->leaf = rowTreeFind(0, &p->pos);
+    p->row = 0;
+    p->njobs = 0;
+    E.search.done = 0;
+    E.search.running = 1;
+
+    // without a thread the rows are searched right here
+    if (qlen && !searchSmall() && searchThreads())
     {
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
+        p->busy = p->nthreads;
+        p->gen++;
+        pthread_cond_broadcast(&p->wake);
     }
-    // if the cursor is in the beginning of the line
-    else
+    else if (qlen)
     {
-        E.cx = E.row[E.cy - 1].size;
-        editorRowAppenedString(&E.row[E.cy - 1], row->chars, row->size);
-        editorDelRow(E.cy);
-        E.cy--;
+        searchWork();
     }
+
+    pthread_mutex_unlock(&p->lock);
+
+    searchPoll();
 }
 
-/* file i/o */
+// how much of the file the running search has been through, in percent
+int searchProgress()
+{
+    long long done = __atomic_load_n(&E.search.done, __ATOMIC_RELAXED);
+
+    return E.numrows ? done * 100 / E.numrows : 100;
+}
 
-char *editorRowsToString(int *buflen)
+// whether q is in the row at column col
+int searchAt(erow *row, int col, const char *q, int qlen)
 {
-    int totlen = 0;
     int j;
 
-    // get the total length of the content
-    for (j = 0; j < E.numrows; j++)
-        totlen += E.row[j].size + 1; // plus 1 for '\n'
-    *buflen = totlen;
-
-    char *buf = malloc(totlen);
-    char *p = buf;
+    if (col + qlen > row->size)
+        return 0;
 
-    // copy all the content into buf
-    for (j = 0; j < E.numrows; j++)
-    {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
-    }
+    for (j = 0; j < qlen; j++)
+        if (ROW_CHAR(row, col + j) != q[j])
+            return 0;
 
-    return buf;
+    return 1;
 }
 
-void editorOpen(char *filename)
+/**
+ * the query grew at its end, so its matches are some of the ones found
+ * already, only those are checked again instead of searching the file
+ */
+void searchRefine(const char *q, int qlen)
 {
-    free(E.filename);
-    // makes a copy of the given string, allocating the required memory
-    // and assuming you will free that memory.
-    E.filename = strdup(filename);
+    struct rownode *leaf = NULL;
+    int pos = 0, filerow = -1;
+    int i, n = 0;
 
-    editorSelectSyntaxHighlight();
+    searchSetQuery(q, qlen);
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp)
-        die("fopen");
+    for (i = 0; i < E.search.found.n; i++)
+    {
+        struct match m = E.search.found.m[i];
 
-    char *line = NULL;
-    size_t linecap = 0; // line capacity
-    ssize_t linelen;
+        // walk to a row close by, look a far one up in the tree
+        if (leaf == NULL || m.row - filerow > ROWTREE_FANOUT)
+        {
+            leaf = rowTreeFind(m.row, &pos);
+            filerow = m.row;
+        }
 
-    // get a line of text from the file and get the length of line it read
-    // whether is the EOF
-    while ((linelen = getline(&line, &linecap, fp)) != -1)
-    {
-        // truncate the \r\n
-        while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                               line[linelen - 1] == '\r'))
-            linelen--;
+        while (filerow < m.row)
+        {
+            ROW_NEXT(leaf, pos);
+            filerow++;
+        }
 
-        editorInsertRow(E.numrows, line, linelen);
+        erow tmp;
+
+        if (searchAt(rowLeafPeek(leaf, pos, &tmp), m.col, q, qlen))
+        {
+            // the match is as long as the new query
+            m.len = qlen;
+            E.search.found.m[n++] = m;
+        }
     }
 
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
+    E.search.found.n = n;
 }
 
-void editorSave()
+// the index of the first match at (row, col) or behind it
+int searchLowerBound(int row, int col)
 {
-    /**
-     * Bash on Windows required to press ESC 3 times to get one ESC keypress
-     * to register in out program, because the read() calls in editorReadKey()
-     * that look for an escape sequemce never time out.
-     */
+    int lo = 0, hi = E.search.found.n;
 
-    if (E.filename == NULL)
+    while (lo < hi)
     {
-        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-
-        if (E.filename == NULL)
-        {
-            editorSetStatusMessage("Save aborted");
-            return;
-        }
+        int mid = lo + (hi - lo) / 2;
+        struct match *m = &E.search.found.m[mid];
 
-        editorSelectSyntaxHighlight();
+        if (m->row < row || (m->row == row && m->col < col))
+            lo = mid + 1;
+        else
+            hi = mid;
     }
 
-    int len;
-    char *buf = editorRowsToString(&len);
+    return lo;
+}
+
+// forget the matches
+void searchEnd()
+{
+    searchStop();
+    searchFreeRe();
+    free(E.search.query);
+    free(E.search.found.m);
+    E.search.query = NULL;
+    E.search.qlen = 0;
+    E.search.found.m = NULL;
+    E.search.found.n = E.search.found.cap = 0;
+    E.search.current = -1;
+    E.search.active = 0;
+}
+
+// move the cursor to the current match
+void editorFindShow()
+{
+    if (E.search.current == -1)
+        return;
+
+    struct match *m = &E.search.found.m[E.search.current];
+
+    E.cy = m->row;
+    E.cx = m->col;
+    E.rowoff = E.numrows;
+}
+
+/**
+ * take the matches of a search that has finished and go to the first one
+ * behind where the search started
+ */
+void searchPoll()
+{
+    int busy;
+
+    if (!E.search.running)
+        return;
+
+    pthread_mutex_lock(&E.search.pool.lock);
+    busy = E.search.pool.busy;
+    pthread_mutex_unlock(&E.search.pool.lock);
 
-    /**
-     * Note: The reason not use O_TRUNC is because it will erase all the
-     * data first when it opens the file. If write() fail, the data from
-     * the file would be lost completely.
-     * The way now is using would only lost some of the data, which much
-     * safer.
-     *
-     * The more advanced editors will write to a new, temporary file, and then
-     * rename that file to the actual file the user wants to overwrite, and they
-     * will carefully check for errors through the whole process.
-     *
-     */
-    // O_CREAT: create a new file if it doesn't already exist
-    // O_RDWR: open file for reading and wrting
-    // read(4), write(2), execute(1), 644
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
+    if (busy)
+        return;
 
-    if (fd != -1)
-    {
-        // set file size to specific length
-        if (ftruncate(fd, len) != -1)
-        {
-            if (write(fd, buf, len) == len)
-            {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
+    searchJoin();
 
-                return;
-            }
-        }
-    }
+    if (E.search.found.n)
+        E.search.current = searchLowerBound(E.search.from_row, E.search.from_col) % E.search.found.n;
 
-    free(buf);
-    // strerror returns human readable string for the error code
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+    editorFindShow();
 }
 
-/* find */
-
 void editorFindCallback(char * query, int key)
 {
-    // always search forward
-    static int last_match = -1;
-    static int direction = 1;
-
-    static int saved_hl_line;
-    static char *saved_hl = NULL;
-
-    // reset the text color back
-    if(saved_hl)
-    {
-        memcpy(E.row[saved_hl_line].hl, saved_hl, E.row[saved_hl_line].rsize);
-        free(saved_hl);
-        saved_hl = NULL;
-    }
+    int n = E.search.found.n;
 
     if(key == '\r' || key == '\x1b')
     {
-        last_match = -1;
-        direction = 1;
-
+        searchEnd();
         return;
     }
-    else if(key == ARROW_RIGHT || key == ARROW_DOWN)
+
+    // while a search runs there are no matches to move through yet
+    if(key == ARROW_RIGHT || key == ARROW_DOWN)
     {
-        direction = 1;
+        if (n)
+            E.search.current = (E.search.current + 1) % n;
     }
     else if(key == ARROW_LEFT || key == ARROW_UP)
     {
-        direction = -1;
+        if (n)
+            E.search.current = (E.search.current + n - 1) % n;
     }
-    else
+
+    if(key == CTRL_KEY('r'))
     {
-        last_match = -1;
-        direction = 1;
+        E.search.regex = !E.search.regex;
+        searchStart(query, strlen(query));
+        return;
     }
 
-    if(last_match == -1)
-        direction = 1;
-
-    // the index of the current row we are searching
-    int current = last_match;
-    int i;
-    for (i = 0; i < E.numrows; i++) // loop through all rows
+    if(!E.search.query || strcmp(query, E.search.query))
     {
-        // go to the next line(+1/-1)
-        current += direction;
-
-        if(current == -1)// cause the cursor go to the end of the file
-            current = E.numrows -1;
-        else if(current == E.numrows) // cause the cursor go back to the start of the file
-            current = 0;
+        int qlen = strlen(query);
 
-        erow *row = &E.row[current];
-        // returns NULL if there is no mathch, otherwise
-        // it returns a pointer to the matching substring.
-        char *match = strstr(row->render, query);
+        // a longer query only keeps some of the matches of the shorter one,
+        // which is not true of a regex
+        if (!E.search.running && !E.search.regex && E.search.qlen > 0 && qlen > E.search.qlen &&
+            !memcmp(query, E.search.query, E.search.qlen))
+        {
+            searchRefine(query, qlen);
 
-        // move the cursor to the target
-        if (match)
+            // go to the first match behind where the search started
+            if (E.search.found.n)
+                E.search.current = searchLowerBound(E.search.from_row, E.search.from_col) % E.search.found.n;
+        }
+        else
         {
-            last_match = current;
-            E.cy = current;
-            // subtract the row->render pointer from the mathch pointer
-            // since match is a pointer into the row->render string
-            // it will get the position of the word
-            E.cx = editorRowRxToCx(row, match - row->render);
-            E.rowoff = E.numrows;
-
-            saved_hl_line = current;
-            saved_hl = malloc(row->rsize);
-            memcpy(saved_hl, row->hl, row->rsize);
-            // (match - row->render) is the index into render of the match
-            memset(&row->hl[match - row->render], HL_MATCH, strlen(query));
-            break;
+            // the matches show up once searchPoll() has them
+            searchStart(query, qlen);
+            return;
         }
     }
+
+    editorFindShow();
 }
 
 void editorFind()
@@ -1035,8 +5748,13 @@ void editorFind()
     int saved_coloff = E.coloff;
     int saved_rowoff = E.rowoff;
 
+    E.search.active = 1;
+    E.search.current = -1;
+    E.search.from_row = E.cy;
+    E.search.from_col = E.cx;
+
     // return NULL when enter Escape Key
-    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)", editorFindCallback);
+    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter, Ctrl-R regex)", editorFindCallback, 0);
 
     if (query)
     {
@@ -1052,6 +5770,137 @@ void editorFind()
     }
 }
 
+/**
+ * put "with" in place of every match in a row, the matches are sorted, and
+ * the ones overlapping a match before them are skipped, so are the empty
+ * ones. Returns how many were replaced, the row is left alone for none
+ */
+int editorReplaceRow(int filerow, struct match *m, int n, const char *with, int withlen)
+{
+    erow *row = editorRowAt(filerow);
+    char *text;
+    int size = 0, cap = row->size, at = 0, done = 0, i;
+    char *chars;
+
+    for (i = 0; i < n; i++)
+    {
+        if (m[i].len > 0)
+        {
+            cap += withlen;
+            done++;
+        }
+    }
+
+    if (done == 0)
+        return 0;
+
+    text = editorRowText(row);
+    chars = slabAlloc(cap + 1);
+
+    for (i = done = 0; i < n; i++)
+    {
+        if (m[i].len == 0 || m[i].col < at)
+            continue;
+
+        memcpy(&chars[size], &text[at], m[i].col - at);
+        size += m[i].col - at;
+        memcpy(&chars[size], with, withlen);
+        size += withlen;
+        at = m[i].col + m[i].len;
+        done++;
+    }
+
+    memcpy(&chars[size], &text[at], row->size - at);
+    size += row->size - at;
+
+    // the one rebuild and highlight of the row
+    editorRowSetText(filerow, chars, size, cap);
+
+    return done;
+}
+
+/**
+ * replace every match of a query in the file. All the matches are found
+ * first, then each row that has some is written once
+ */
+void editorReplace()
+{
+    int saved_cx = E.cx;
+    int saved_cy = E.cy;
+    int saved_coloff = E.coloff;
+    int saved_rowoff = E.rowoff;
+    char prompt[128];
+    int i, j, k, rows = 0, replaced = 0;
+
+    char *query = editorPrompt(E.search.regex ? "Replace regex: %s (ESC to cancel)" :
+                               "Replace: %s (ESC to cancel)", NULL, 0);
+
+    if (query == NULL)
+        return;
+
+    // the query goes into the format of the next prompt, so its '%' are doubled
+    for (i = j = 0; query[i] && j < (int)sizeof(prompt) - 32; i++)
+    {
+        if (query[i] == '%')
+            prompt[j++] = '%';
+        prompt[j++] = query[i];
+    }
+    strcpy(&prompt[j], " with: %s (empty = nothing)");
+
+    // an empty line replaces the matches with nothing
+    char *with = editorPrompt(prompt, NULL, 1);
+
+    if (with == NULL)
+    {
+        free(query);
+        return;
+    }
+
+    // a small file is searched before searchStart() returns, a big one
+    // is waited for here
+    searchStart(query, strlen(query));
+    if (E.search.running)
+        searchJoin();
+
+    if (E.search.regex && E.search.qlen && !E.search.re)
+    {
+        searchEnd();
+        free(query);
+        free(with);
+        editorSetStatusMessage("Replace aborted: bad regex");
+        return;
+    }
+
+    int n = E.search.found.n;
+    struct match *m = E.search.found.m;
+    int withlen = strlen(with);
+
+    for (i = 0; i < n; i = k)
+    {
+        for (k = i + 1; k < n && m[k].row == m[i].row; k++)
+            ;
+
+        int done = editorReplaceRow(m[i].row, &m[i], k - i, with, withlen);
+
+        replaced += done;
+        rows += done > 0;
+    }
+
+    searchEnd();
+    free(query);
+    free(with);
+
+    E.cx = saved_cx;
+    E.cy = saved_cy;
+    E.coloff = saved_coloff;
+    E.rowoff = saved_rowoff;
+
+    if (E.cy < E.numrows && E.cx > editorRowAt(E.cy)->size)
+        E.cx = editorRowAt(E.cy)->size;
+
+    editorSetStatusMessage("%d replaced in %d rows", replaced, rows);
+}
+
 // it would be a good idea to do one big write other than a bunch of small
 // write(), it could make sure whole screen updates at once, to prevent
 // the annoying flicker effect
@@ -1061,28 +5910,40 @@ struct abuf
 {
     char *b;
     int len;
+    int cap; // the buffer only grows, so a reused abuf stops allocating
 };
 
 #define ABUF_INIT \
 {             \
-    NULL, 0   \
+    NULL, 0, 0 \
 }
 
 void abAppend(struct abuf *ab, const char *s, int len)
 {
-    char *new = realloc(ab->b, ab->len + len);
+    if (ab->len + len > ab->cap)
+    {
+        int cap = ab->cap ? ab->cap : 4096;
 
-    if (new == NULL)
-        return;
+        while (cap < ab->len + len)
+            cap *= 2;
+
+        char *new = realloc(ab->b, cap);
 
-    memcpy(&new[ab->len], s, len);
-    ab->b = new;
+        if (new == NULL)
+            return;
+
+        ab->b = new;
+        ab->cap = cap;
+    }
+
+    memcpy(&ab->b[ab->len], s, len);
     ab->len += len;
 }
 
-void abFree(struct abuf *ab)
+// empty the buffer but keep the memory for the next frame
+void abReset(struct abuf *ab)
 {
-    free(ab->b);
+    ab->len = 0;
 }
 
 /* output */
@@ -1094,7 +5955,7 @@ void editorScroll()
     //if there is a '\t'
     if (E.cy < E.numrows)
     {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+        E.rx = editorRowCxToRx(editorRowAt(E.cy), E.cx);
     }
 
     // if the cursor is above the visible window, then scrolls up
@@ -1121,13 +5982,101 @@ void editorScroll()
     }
 }
 
-void editorDrawRows(struct abuf *ab)
+struct sgr
+{
+    const char *seq;
+    int len;
+};
+
+#define SGR(s) { s, sizeof(s) - 1 }
+#define SGR_ATTRS(inverse, s) \
+    [(inverse) | HL_NORMAL] = SGR("\x1b[0" s "m"), \
+    [(inverse) | HL_COMMENT] = SGR("\x1b[0" s ";36m"), /* blue */ \
+    [(inverse) | HL_MLCOMMENT] = SGR("\x1b[0" s ";36m"), \
+    [(inverse) | HL_KEYWORD1] = SGR("\x1b[0" s ";33m"), /* yellow */ \
+    [(inverse) | HL_KEYWORD2] = SGR("\x1b[0" s ";32m"), /* green */ \
+    [(inverse) | HL_STRING] = SGR("\x1b[0" s ";35m"), /* purple */ \
+    [(inverse) | HL_NUMBER] = SGR("\x1b[0" s ";31m"), /* red */ \
+    [(inverse) | HL_MATCH] = SGR("\x1b[0" s ";34m")
+
+// the escape sequence switching to each cell attribute
+const struct sgr SGR_TABLE[2 * ATTR_INVERSE] = {
+    SGR_ATTRS(0, ""),
+    SGR_ATTRS(ATTR_INVERSE, ";7"),
+};
+
+// (re)allocate the frames for the current screen size and repaint everything
+void editorScreenResize()
+{
+    int cells = (E.screenrows + 2) * E.screencols;
+
+    free(E.front.ch);
+    free(E.front.attr);
+    free(E.back.ch);
+    free(E.back.attr);
+
+    E.front.ch = malloc(cells);
+    E.front.attr = malloc(cells);
+    E.back.ch = malloc(cells);
+    E.back.attr = malloc(cells);
+
+    if (!E.front.ch || !E.front.attr || !E.back.ch || !E.back.attr)
+        die("malloc");
+
+    E.screen_valid = 0;
+}
+
+// blank line y of the frame being drawn
+void scrClear(int y, unsigned char attr)
+{
+    memset(&E.back.ch[y * E.screencols], ' ', E.screencols);
+    memset(&E.back.attr[y * E.screencols], attr, E.screencols);
+}
+
+// put len chars at column x of line y, the ones past the edge are dropped
+void scrPut(int y, int x, const char *s, int len, unsigned char attr)
+{
+    if (len > E.screencols - x)
+        len = E.screencols - x;
+
+    if (len <= 0)
+        return;
+
+    memcpy(&E.back.ch[y * E.screencols + x], s, len);
+    memset(&E.back.attr[y * E.screencols + x], attr, len);
+}
+
+// mark the matches of the search in a row on the screen, the current one inverted
+void editorDrawMatches(int filerow, erow *row, unsigned char *attr, int len)
+{
+    int *matches = searchRowMatches(row);
+    struct match *cur = E.search.current == -1 ? NULL : &E.search.found.m[E.search.current];
+    int i, j;
+
+    for (i = 0; i < matches[1]; i++)
+    {
+        int col = matches[2 + 2 * i];
+        int from = editorRowCxToRx(row, col) - E.coloff;
+        int to = editorRowCxToRx(row, col + matches[3 + 2 * i]) - E.coloff;
+        unsigned char a = HL_MATCH;
+
+        if (cur && cur->row == filerow && cur->col == col)
+            a |= ATTR_INVERSE;
+
+        for (j = from < 0 ? 0 : from; j < to && j < len; j++)
+            attr[j] = a;
+    }
+}
+
+void editorDrawRows()
 {
     int y;
     for (y = 0; y < E.screenrows; y++)
     {
         int filerow = y + E.rowoff;
 
+        scrClear(y, 0);
+
         // whether is drawing a row that is part of the text buffer, or a row that comes after the end of the text buffer
         if (filerow >= E.numrows)
         {
@@ -1144,26 +6093,24 @@ void editorDrawRows(struct abuf *ab)
 
                 int padding = (E.screencols - welcomelen) / 2;
                 if (padding)
-                {
-                    abAppend(ab, "~", 1);
-                    padding--;
-                }
-
-                while (padding--)
-                    abAppend(ab, " ", 1);
+                    scrPut(y, 0, "~", 1, 0);
 
-                abAppend(ab, welcome, welcomelen);
+                scrPut(y, padding, welcome, welcomelen, 0);
             }
             else
             {
                 // draw tilde
-                abAppend(ab, "~", 1);
+                scrPut(y, 0, "~", 1, 0);
             }
         }
         else
         {
+            editorPrepareRow(filerow);
+
+            erow *row = editorRowAt(filerow);
+
             // display a line of text in the screen
-            int len = E.row[filerow].rsize - E.coloff;
+            int len = row->rsize - E.coloff;
 
             if (len < 0)
                 len = 0;
@@ -1171,68 +6118,48 @@ void editorDrawRows(struct abuf *ab)
             if (len > E.screencols)
                 len = E.screencols;
 
-            char *c = &E.row[filerow].render[E.coloff];
-            unsigned char *hl = &E.row[filerow].hl[E.coloff];
-            // the defualt text color
-            int current_color = -1;
-            int j;
+            char *c = &editorRowRender(row)[E.coloff];
+            char *ch = &E.back.ch[y * E.screencols];
+            unsigned char *attr = &E.back.attr[y * E.screencols];
+            int j, k;
 
-            for(j = 0; j < len; j++)
-            {
-                if(iscntrl(c[j]))
-                {
-                    char sym = (c[j] <= 26) ? '@' + c[j] : '?';
-                    abAppend(ab, "\x1b[7m", 4);
-                    abAppend(ab, &sym, 1);
-                    abAppend(ab, "\x1b[m", 3);
+            memcpy(ch, c, len);
 
-                    if(current_color != -1)
-                    {
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", current_color);
+            // the cells of a span share its highlight, from the span the left edge is in
+            memset(attr, HL_NORMAL, len);
 
-                        abAppend(ab, buf, clen);
-                    }
-                }
-                else if(hl[j] == HL_NORMAL)
-                {
-                    if(current_color != -1)
-                    {
-                        // set the color to normal
-                        abAppend(ab, "\x1b[39m", 5);
-
-                        current_color = -1;
-                    }
-                    abAppend(ab, &c[j], 1);
-                }
-                else
-                {
-                    int color = editorSyntaxToColor(hl[j]);
-                    if(color != current_color)
-                    {
-                        current_color = color;
+            for (k = editorHlSpanAt(row, E.coloff), j = 0; k >= 0 && k < row->hl_n && j < len; k++)
+            {
+                int end = (k + 1 < row->hl_n) ? editorHlStart(row, k + 1) - E.coloff : len;
 
-                        char buf[16];
-                        int clen = snprintf(buf, sizeof(buf), "\x1b[%dm", color);
+                if (end > len)
+                    end = len;
 
-                        abAppend(ab, buf, clen);
-                    }
+                memset(&attr[j], HL_SPAN_HL(row, k), end - j);
+                j = end;
+            }
 
-                    abAppend(ab, &c[j], 1);
+            for(j = 0; j < len; j++)
+            {
+                if(iscntrl(c[j]))
+                {
+                    ch[j] = (c[j] <= 26) ? '@' + c[j] : '?';
+                    attr[j] = ATTR_INVERSE;
                 }
             }
-            abAppend(ab, "\x1b[39m", 5);
-        }
 
-        abAppend(ab, "\x1b[K", 3);
-        abAppend(ab, "\r\n", 2);
+            if (E.search.active && E.search.query)
+                editorDrawMatches(filerow, row, attr, len);
+        }
     }
 }
 
-void editorDrawStatusBar(struct abuf *ab)
+void editorDrawStatusBar()
 {
-    // switch to inverted colors
-    abAppend(ab, "\x1b[7m", 4);
+    int y = E.screenrows;
+
+    // the status bar is in inverted colors
+    scrClear(y, ATTR_INVERSE);
 
     // left status, right status
     char status[80], rstatus[80];
@@ -1240,73 +6167,190 @@ void editorDrawStatusBar(struct abuf *ab)
     int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
                        E.filename ? E.filename : "[No Name]", E.numrows,
                        E.dirty ? "(modified)" : "");
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
+    int rlen;
+
+    if (E.search.running)
+        rlen = snprintf(rstatus, sizeof(rstatus), "searching... %d%% done",
+                        searchProgress());
+    else if (E.search.active && E.search.regex && E.search.qlen && !E.search.re)
+        rlen = snprintf(rstatus, sizeof(rstatus), "bad regex");
+    else if (E.search.active)
+        rlen = snprintf(rstatus, sizeof(rstatus), "%smatch %d of %d",
+                        E.search.regex ? "regex " : "",
+                        E.search.current + 1, E.search.found.n);
+    else
+        rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d/%d",
                         E.syntax ? E.syntax->filetype : "no ft", E.cy + 1, E.numrows);
 
     if (len > E.screencols)
         len = E.screencols;
 
-    abAppend(ab, status, len);
-
-    while (len < E.screencols)
-    {
-        if (E.screencols - len == rlen)
-        {
-            abAppend(ab, rstatus, rlen);
-            break;
-        }
-        else
-        {
-            abAppend(ab, " ", 1);
-            len++;
-        }
-    }
+    scrPut(y, 0, status, len, ATTR_INVERSE);
 
-    // switch back to normal formatting
-    abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
+    if (E.screencols - len >= rlen)
+        scrPut(y, E.screencols - rlen, rstatus, rlen, ATTR_INVERSE);
 }
 
-void editorDrawMessageBar(struct abuf *ab)
+void editorDrawMessageBar()
 {
+    int y = E.screenrows + 1;
+
     // clear the message bar
-    abAppend(ab, "\x1b[K", 3);
+    scrClear(y, 0);
 
     int msglen = strlen(E.statusmsg);
 
     if (msglen > E.screencols)
         msglen = E.screencols;
 
-    // only the msg is fix to the bar and the file is opened after less than 5 sec
-    if (msglen && time(NULL) - E.statusmsg_time < 5)
-        abAppend(ab, E.statusmsg, msglen);
+    // only the msg is fix to the bar and the file is opened after less than KILO_MSG_TIMEOUT sec
+    if (msglen && time(NULL) - E.statusmsg_time < KILO_MSG_TIMEOUT)
+        scrPut(y, 0, E.statusmsg, msglen, 0);
+}
+
+/**
+ * write the cells of the back frame that differ from the front one, spans of
+ * a line closer than KILO_SCREEN_GAP are written as one, and a blank tail is
+ * cleared with <esc>[K instead of spaces. A cell is a byte, which is only a
+ * terminal column for ASCII, so a changed line with UTF-8 in either frame
+ * is written whole
+ */
+int editorFlushScreen(struct abuf *ab)
+{
+    int cols = E.screencols;
+    int changed = 0;
+    unsigned char cur = 0;
+    char buf[32];
+    int y, x, j;
+
+    for (y = 0; y < E.screenrows + 2; y++)
+    {
+        char *bch = &E.back.ch[y * cols], *fch = &E.front.ch[y * cols];
+        unsigned char *battr = &E.back.attr[y * cols], *fattr = &E.front.attr[y * cols];
+
+        // the line is blank from column tail on
+        int tail = cols;
+        while (tail > 0 && bch[tail - 1] == ' ' && battr[tail - 1] == 0)
+            tail--;
+
+        int wide = 0;
+        for (x = 0; x < cols && !wide; x++)
+            wide = (unsigned char)bch[x] >= 0x80 || (unsigned char)fch[x] >= 0x80;
+
+#define CELL_DIFFERS(x) \
+    (!E.screen_valid || bch[x] != fch[x] || battr[x] != fattr[x])
+
+        for (x = 0; x < cols; x++)
+        {
+            if (!CELL_DIFFERS(x))
+                continue;
+
+            int end = x;
+            for (j = x + 1; j < cols && j - end <= KILO_SCREEN_GAP; j++)
+                if (CELL_DIFFERS(j))
+                    end = j;
+
+            if (wide)
+            {
+                x = 0;
+                end = cols - 1;
+            }
+
+            int stop = end < tail ? end + 1 : tail;
+
+            if (!changed)
+            {
+                abAppend(ab, "\x1b[?25l", 6);
+                changed = 1;
+            }
+
+            abAppend(ab, buf, snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1));
+
+            // each run of cells with the same attribute is one copy
+            for (j = x; j < stop; )
+            {
+                int k = j + 1;
+
+                while (k < stop && battr[k] == battr[j])
+                    k++;
+
+                if (battr[j] != cur)
+                {
+                    cur = battr[j];
+                    abAppend(ab, SGR_TABLE[cur].seq, SGR_TABLE[cur].len);
+                }
+                abAppend(ab, &bch[j], k - j);
+                j = k;
+            }
+
+            if (end >= tail)
+            {
+                if (cur != 0)
+                {
+                    cur = 0;
+                    abAppend(ab, "\x1b[m", 3);
+                }
+                abAppend(ab, "\x1b[K", 3);
+                break;
+            }
+
+            x = end;
+        }
+
+#undef CELL_DIFFERS
+    }
+
+    if (cur != 0)
+        abAppend(ab, "\x1b[m", 3);
+
+    // the back frame is redrawn from scratch every time, so just swap them
+    struct screen tmp = E.front;
+    E.front = E.back;
+    E.back = tmp;
+    E.screen_valid = 1;
+
+    return changed;
 }
 
 void editorRefreshScreen()
 {
     editorScroll();
 
-    struct abuf ab = ABUF_INIT;
+    // the frame buffer is kept across refreshes
+    static struct abuf ab = ABUF_INIT;
 
-    abAppend(&ab, "\x1b[?25l", 6);
-    abAppend(&ab, "\x1b[H", 3);
+    abReset(&ab);
 
-    editorDrawRows(&ab);
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
+    editorDrawRows();
+    editorDrawStatusBar();
+    editorDrawMessageBar();
 
-    char buf[32];
+    int changed = editorFlushScreen(&ab);
 
     // the first calculation gets screenrows or a number lower than screenrows
     // which it is still in the screen. Note: cy could be changed.
     // E.cy - E.rowoff <= screenrows
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1, (E.rx - E.coloff) + 1);
-    abAppend(&ab, buf, strlen(buf));
+    int cy = (E.cy - E.rowoff) + 1, cx = (E.rx - E.coloff) + 1;
+
+    if (changed || cy != E.term_cy || cx != E.term_cx)
+    {
+        char buf[32];
+
+        snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cy, cx);
+        abAppend(&ab, buf, strlen(buf));
+        E.term_cy = cy;
+        E.term_cx = cx;
+    }
 
-    abAppend(&ab, "\x1b[?25h", 6);
+    if (changed)
+        abAppend(&ab, "\x1b[?25h", 6);
 
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+    if (ab.len)
+        write(STDOUT_FILENO, ab.b, ab.len);
+
+    E.frames++;
+    E.frame_bytes = ab.len;
+    E.total_bytes += ab.len;
 }
 
 void editorSetStatusMessage(const char *fmt, ...)
@@ -1326,7 +6370,11 @@ void editorSetStatusMessage(const char *fmt, ...)
 
 /* input */
 
-char *editorPrompt(char *prompt, void (*callback)(char *, int))
+/**
+ * ask for a line on the message bar, NULL if it's cancelled with ESC. An
+ * empty line is only taken when "empty" is set
+ */
+char *editorPrompt(char *prompt, void (*callback)(char *, int), int empty)
 {
     size_t bufsize = 128;
     char *buf = malloc(bufsize);
@@ -1361,7 +6409,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int))
         // if user pree ENTER key
         else if (c == '\r')
         {
-            if (buflen != 0)
+            if (buflen != 0 || empty)
             {
                 editorSetStatusMessage("");
 
@@ -1392,7 +6440,7 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int))
 void editorMoveCursor(int key)
 {
     // if there is a row from the file, the row would be defined
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    erow *row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
 
     switch (key)
     {
@@ -1404,7 +6452,7 @@ void editorMoveCursor(int key)
         else if (E.cy > 0) //move the cursor to the end of previous line if the cursor in the beginning of the line
         {
             E.cy--;
-            E.cx = E.row[E.cy].size;
+            E.cx = editorRowAt(E.cy)->size;
         }
         break;
 
@@ -1438,7 +6486,7 @@ void editorMoveCursor(int key)
 
     // check whether the line is shorter or longer than the previous line
     // if so, change the position of the cursor
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
+    row = (E.cy >= E.numrows) ? NULL : editorRowAt(E.cy);
     int rowlen = row ? row->size : 0;
 
     if (E.cx > rowlen)
@@ -1448,12 +6496,45 @@ void editorMoveCursor(int key)
 }
 
 // convert the input into actions
+/**
+ * take the bytes of a bracketed paste as they are, up to <esc>[201~, and
+ * insert them all at once
+ */
+void editorPaste()
+{
+    static const char end[] = "\x1b[201~";
+    size_t endlen = sizeof(end) - 1;
+    size_t bufsize = 4096, buflen = 0;
+    char *buf = malloc(bufsize);
+
+    while (buflen < endlen || buf[buflen - 1] != '~' ||
+           memcmp(&buf[buflen - endlen], end, endlen))
+    {
+        while (INRING_LEN() == 0)
+            inputFill(-1);
+
+        if (buflen == bufsize)
+        {
+            bufsize *= 2;
+            buf = realloc(buf, bufsize);
+        }
+
+        buf[buflen++] = INRING_AT(0);
+        E.in.head++;
+    }
+
+    editorInsertText(buf, buflen - endlen);
+    free(buf);
+}
+
 void editorProcessKeypress()
 {
     // only initialize once
     static int quit_times = KILO_QUIT_TIMES;
     int c = editorReadKey();
 
+    undoKey(c);
+
     switch (c)
     {
     case '\r':
@@ -1464,6 +6545,9 @@ void editorProcessKeypress()
          * other than ^q
          */
     case CTRL_KEY('q'):
+        // a save that is still running decides whether anything is unsaved
+        editorSaveWait();
+
         if (E.dirty && quit_times > 0)
         {
             editorSetStatusMessage("WARNING!!! File has unsaved changes. "
@@ -1472,6 +6556,10 @@ void editorProcessKeypress()
             quit_times--;
             return;
         }
+        // the edits were given up on, so their journal goes too
+        if (E.journal.path && !E.journal.kept)
+            unlink(E.journal.path);
+
         // clear entire screen
         write(STDOUT_FILENO, "\x1b[2J", 4);
         // reposite the cursor <esc>[1;1H to the top left corner
@@ -1483,19 +6571,38 @@ void editorProcessKeypress()
         editorSave();
         break;
 
+    case PASTE_START:
+        editorPaste();
+        break;
+
+    case PASTE_END:
+        break;
+
     case HOME_KEY:
         E.cx = 0;
         break;
 
     case END_KEY:
         if (E.cy < E.numrows)
-            E.cx = E.row[E.cy].size;
+            E.cx = editorRowAt(E.cy)->size;
         break;
 
     case CTRL_KEY('f'):
         editorFind();
         break;
 
+    case CTRL_KEY('r'):
+        editorReplace();
+        break;
+
+    case CTRL_KEY('z'):
+        editorUndo();
+        break;
+
+    case CTRL_KEY('y'):
+        editorRedo();
+        break;
+
     case BACKSPACE:
     case CTRL_KEY('h'):
     case DEL_KEY:
@@ -1539,7 +6646,16 @@ void editorProcessKeypress()
         editorMoveCursor(c);
         break;
 
+    case CTRL_KEY('g'):
+        editorSetStatusMessage("%lu frames, last %d bytes, %lu bytes in total",
+                               E.frames, E.frame_bytes, E.total_bytes);
+        break;
+
+        // repaint the whole screen
     case CTRL_KEY('l'):
+        E.screen_valid = 0;
+        break;
+
     case '\x1b':
         break;
 
@@ -1563,17 +6679,66 @@ void initEditor()
     E.rowoff = 0;
     E.coloff = 0;
     E.numrows = 0;
-    E.row = NULL;
+    E.rows = rowNodeNew(1);
+    E.hl_valid_rows = 0;
+    E.map = NULL;
+    E.mapsize = 0;
     E.dirty = 0;
     E.filename = NULL;
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
     E.syntax = NULL;
+    E.search.query = NULL;
+    E.search.qlen = 0;
+    E.search.found.m = NULL;
+    E.search.found.n = E.search.found.cap = 0;
+    E.search.current = -1;
+    E.search.active = 0;
+    E.search.regex = 0;
+    E.search.re = NULL;
+    E.search.gen = 0;
+    E.search.fwd = E.search.rev = NULL;
+    memset(&E.search.scan, 0, sizeof(E.search.scan));
+    memset(&E.search.pool, 0, sizeof(E.search.pool));
+    pthread_mutex_init(&E.search.pool.lock, NULL);
+    pthread_cond_init(&E.search.pool.wake, NULL);
+    pthread_cond_init(&E.search.pool.idle, NULL);
+    E.search.running = 0;
+    E.search.cancel = 0;
+    E.save.pid = 0;
+    E.save.fd = -1;
+    E.journal.on = 0;
+    E.journal.kept = 0;
+    E.journal.fd = -1;
+    E.journal.path = NULL;
+    E.journal.pos = 0;
+    E.journal.buf = NULL;
+    E.journal.len = E.journal.cap = 0;
+    E.journal.unsynced = 0;
+    E.undo.log = NULL;
+    E.undo.len = E.undo.cap = E.undo.pos = 0;
+    E.undo.last = -1;
+    E.undo.boundary = 1;
+    E.undo.cx = E.undo.cy = 0;
+    E.undo.kind = UK_OTHER;
+    E.undo.lastc = 0;
+    E.undo.paused = 0;
+    E.undo.overflow = 0;
+    memset(&E.slab, 0, sizeof(E.slab));
+    E.front.ch = E.back.ch = NULL;
+    E.front.attr = E.back.attr = NULL;
+    E.term_cy = E.term_cx = 0;
+    E.frames = 0;
+    E.frame_bytes = 0;
+    E.total_bytes = 0;
 
     if (getWindowSize(&E.screenrows, &E.screencols) == -1)
         die("getWindowSize");
 
     E.screenrows -= 2;
+
+    editorScreenResize();
+    enableSignals();
 }
 
 int main(int argc, char *argv[])
@@ -1585,14 +6750,24 @@ int main(int argc, char *argv[])
         editorOpen(argv[1]);
     }
 
-    editorSetStatusMessage("HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find");
+    editorSetStatusMessage("HELP: Ctrl-S save | Ctrl-Q quit | Ctrl-F find | Ctrl-R replace | Ctrl-Z undo");
+
+    // this may replace the help with what was recovered
+    if (E.filename)
+        journalStart();
 
     // read 1 byte from the standard input into c until no more bytes from the buffer
     // read returns the bytes it read, 0 indicate the EOF
     while (1)
     {
         editorRefreshScreen();
-        editorProcessKeypress();
+
+        // handle every key that has arrived, then draw the result once
+        do
+        {
+            editorProcessKeypress();
+            editorScroll();
+        } while (editorKeyPending());
     }
 
     return 0;